@@ -21,6 +21,8 @@
 #ifndef FLASH_H_
 #define FLASH_H_
 
-void FLASH_WritePage(uint16_t *page, uint16_t *data, uint16_t size);
+void FLASH_WritePage(uint16_t *page, uint16_t *data, uint16_t size,
+	bool erase);
+uint32_t FLASH_CRC(uint32_t *address, uint32_t words);
 
 #endif /* FLASH_H_ */
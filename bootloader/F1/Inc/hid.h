@@ -26,5 +26,6 @@ extern volatile bool UploadFinished;
 /* Function Prototypes */
 void USB_Reset(void);
 void USB_EPHandler(uint16_t Status);
+void HIDUSB_FlashPages(void);
 
 #endif /* HID_H_ */
@@ -0,0 +1,91 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+* Copyright (c) 2018 Bruno Freitas - bruno@brunofreitas.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+* Protocol and page assembly, split from hid.c
+*/
+
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+/* Flash memory base address, and Flash size register (in kB). The host
+ * build of the protocol (see bootloader/host) points them to a simulated
+ * Flash memory.
+ */
+#ifndef FLASH_BASE_ADDRESS
+#define FLASH_BASE_ADDRESS	0x08000000
+#endif
+#ifndef FLASH_SIZE_ADDRESS
+#define FLASH_SIZE_ADDRESS	0x1FFFF7E0
+#endif
+
+/* Optional features (see the Makefile) */
+#ifndef WITH_SERIAL_NUMBER
+#define WITH_SERIAL_NUMBER	1
+#endif
+#ifndef WITH_PAGE_CRC
+#define WITH_PAGE_CRC		1
+#endif
+#ifndef WITH_PROGRESS
+#define WITH_PROGRESS		1
+#endif
+
+/* *
+ * HOST_PAGE_SIZE : Page size used by the host
+ *  The host always sends 1 kB pages. Low and MEDIUM Density F103
+ *  devices have 1 kB Flash page, High Density F103 devices have 2 kB
+ *  Flash page, that are written in two halves (see FLASH_WritePage())
+ *
+ * MIN_PAGE : This should be the first 1 kB page right after the
+ *  bootloader. In any case, the bootloader size is 2048 bytes
+ */
+#define HOST_PAGE_SIZE		1024
+#define MIN_PAGE		2
+
+/* Maximum packet size and polling interval (ms) of the interrupt OUT endpoint */
+#define OUT_PACKET_SIZE		64
+#define OUT_POLL_INTERVAL	1
+
+/* Reply size (sent on EP1) */
+#define REPLY_SIZE		16
+
+/* Commands */
+#define CMD_RESET_PAGES		0x00
+#define CMD_REBOOT_MCU		0x01
+#define CMD_PAGE_WRITTEN	0x02
+#define CMD_GET_INFO		0x03
+#define CMD_GET_CRC		0x04
+#define CMD_SET_PAGE		0x05
+#define CMD_VERIFY		0x06
+#define CMD_GET_PROGRESS	0x09
+
+/* Pages written since <reset pages>, and last count acknowledged */
+extern volatile uint16_t PagesWritten;
+extern uint16_t PagesAcknowledged;
+
+/* Function Prototypes */
+void HIDUSB_SendReply(uint8_t code, uint32_t arg0, uint32_t arg1);
+uint16_t *HIDUSB_TakeReply(void);
+void HIDUSB_ResetPages(void);
+#if WITH_PROGRESS
+void HIDUSB_AbortPage(void);
+#endif
+bool HIDUSB_HandleData(uint8_t *data, uint8_t length);
+bool HIDUSB_CanReceive(void);
+bool HIDUSB_NextPage(void);
+void HIDUSB_WritePage(void);
+
+#endif /* PROTOCOL_H_ */
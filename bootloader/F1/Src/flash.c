@@ -20,10 +20,23 @@
 */
 
 #include <stm32f10x.h>
+#include <stdbool.h>
 #include "flash.h"
 
-void FLASH_WritePage(uint16_t *page, uint16_t *data, uint16_t size)
+static bool FLASH_PageIsBlank(uint32_t *page)
 {
+	for (uint16_t i = 0; i < PAGE_SIZE / 4; i++) {
+		if (page[i] != 0xFFFFFFFF) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void FLASH_WritePage(uint16_t *page, uint16_t *data, uint16_t size,
+	bool erase)
+{
+	uint32_t flash_page = (uint32_t) page & ~(PAGE_SIZE - 1);
 
 	/* Unlock Flash with magic keys */
 	WRITE_REG(FLASH->KEYR, FLASH_KEY1);
@@ -32,14 +45,20 @@ void FLASH_WritePage(uint16_t *page, uint16_t *data, uint16_t size)
 		;
 	}
 
-	/* Format page */
-	SET_BIT(FLASH->CR, FLASH_CR_PER);
-	WRITE_REG(FLASH->AR, (uint32_t) page);
-	SET_BIT(FLASH->CR, FLASH_CR_STRT);
-	while (READ_BIT(FLASH->SR, FLASH_SR_BSY)) {
-		;
+	/* Format the Flash page holding this page when asked to (High
+	 * Density devices have 2 kB pages, that are written in two 1 kB
+	 * halves), unless it is already erased: reading it is much faster
+	 * than erasing it
+	 */
+	if (erase && !FLASH_PageIsBlank((uint32_t *) flash_page)) {
+		SET_BIT(FLASH->CR, FLASH_CR_PER);
+		WRITE_REG(FLASH->AR, flash_page);
+		SET_BIT(FLASH->CR, FLASH_CR_STRT);
+		while (READ_BIT(FLASH->SR, FLASH_SR_BSY)) {
+			;
+		}
+		CLEAR_BIT(FLASH->CR, FLASH_CR_PER);
 	}
-	CLEAR_BIT(FLASH->CR, FLASH_CR_PER);
 
 	/* Write page data */
 	while (READ_BIT(FLASH->SR, FLASH_SR_BSY)) {
@@ -58,3 +77,15 @@ void FLASH_WritePage(uint16_t *page, uint16_t *data, uint16_t size)
 	SET_BIT(FLASH->CR, FLASH_CR_LOCK);
 }
 
+uint32_t FLASH_CRC(uint32_t *address, uint32_t words)
+{
+
+	/* CRC32 (Ethernet polynomial) computed by the CRC unit */
+	SET_BIT(RCC->AHBENR, RCC_AHBENR_CRCEN);
+	WRITE_REG(CRC->CR, CRC_CR_RESET);
+	while (words--) {
+		WRITE_REG(CRC->DR, *address++);
+	}
+	return READ_REG(CRC->DR);
+}
+
@@ -28,34 +28,14 @@
 #include "usb.h"
 #include "hid.h"
 #include "led.h"
-#include "flash.h"
+#include "protocol.h"
 
 /* This should be <= MAX_EP_NUM defined in usb.h */
 #define EP_NUM 			2
 
-/* Flash memory base address */
-#define FLASH_BASE_ADDRESS	0x08000000
-
-/* *
- * PAGE_SIZE : Flash Page size
- *  Low and MEDIUM Density F103 devices have 1 kB Flash page
- *  High Density F103 devices have 2 kB Flash page
- *
- * PAGEMIN : This should be the last page taken by the bootloader
- *  (2 * 1024) or (1 * 2048) In any case, the bootloader size is 2048 bytes
- */
-#if (PAGE_SIZE == 2048)
-#define MIN_PAGE		1
-#else
-#define MIN_PAGE		2
-#endif
-
 /* Maximum packet size */
 #define MAX_PACKET_SIZE		8
 
-/* Command size */
-#define COMMAND_SIZE		64
-
 /* Buffer table offsset in PMA memory */
 #define BTABLE_OFFSET		(0x00)
 
@@ -65,26 +45,17 @@
 #define ENDP0_TXADDR		(0x58)
 
 /* EP1  */
-/* TX buffer base address */
+/* RX/TX buffer base address */
 #define ENDP1_TXADDR		(0x100)
+#define ENDP1_RXADDR		(0x110)
 
-/* Upload started flag */
-volatile bool UploadStarted;
-
-/* Upload finished flag */
-volatile bool UploadFinished;
-
-/* Sent command (Received command is the same minus last byte) */
-static const uint8_t Command[] = {'B', 'T', 'L', 'D', 'C', 'M', 'D', 2};
-
-/* Flash page buffer */
-static uint8_t PageData[PAGE_SIZE];
-
-/* Current page number (starts right after bootloader's end) */
-static volatile uint8_t CurrentPage;
+/* Reception byte count for a 64-byte buffer: BL_SIZE = 1 (32-byte
+ * blocks), NUM_BLOCK = 1 (2 blocks)
+ */
+#define ENDP1_RXCOUNT		(0x8000 | (1 << 10))
 
-/* Byte offset in flash page */
-static volatile uint16_t CurrentPageOffset;
+/* 96-bit unique device ID */
+#define UID_ADDRESS		0x1FFFF7E8
 
 /* USB Descriptors */
 static const uint8_t USB_DeviceDescriptor[] = {
@@ -97,17 +68,21 @@ static const uint8_t USB_DeviceDescriptor[] = {
 	MAX_PACKET_SIZE,	// bMaxPacketSize0 8
 	0x09, 0x12,		// idVendor 0x1209
 	0xBA, 0xBE,		// idProduct 0xBEBA
-	0x00, 0x03,		// bcdDevice 3.00
+	0x10, 0x03,		// bcdDevice 3.10
 	0x01,			// iManufacturer (String Index)
 	0x02,			// iProduct (String Index)
-	0x00,			// iSerialNumber (String Index)
+#if WITH_SERIAL_NUMBER
+	0x03,			// iSerialNumber (String Index)
+#else
+	0x00,			// iSerialNumber (none)
+#endif
 	0x01 			// bNumConfigurations 1
 };
 
 static const uint8_t USB_ConfigurationDescriptor[] = {
 	0x09,			// bLength
 	0x02,			// bDescriptorType (Configuration)
-	0x22, 0x00,		// wTotalLength 34
+	0x29, 0x00,		// wTotalLength 41
 	0x01,			// bNumInterfaces 1
 	0x01,			// bConfigurationValue
 	0x00,			// iConfiguration (String Index)
@@ -118,7 +93,7 @@ static const uint8_t USB_ConfigurationDescriptor[] = {
 	0x04,			// bDescriptorType (Interface)
 	0x00,			// bInterfaceNumber 0
 	0x00,			// bAlternateSetting
-	0x01,			// bNumEndpoints 1
+	0x02,			// bNumEndpoints 2
 	0x03,			// bInterfaceClass
 	0x00,			// bInterfaceSubClass
 	0x00,			// bInterfaceProtocol
@@ -136,8 +111,15 @@ static const uint8_t USB_ConfigurationDescriptor[] = {
 	0x05,			// bDescriptorType (Endpoint)
 	0x81,			// bEndpointAddress (IN/D2H)
 	0x03,			// bmAttributes (Interrupt)
-	MAX_PACKET_SIZE, 0x00,	// wMaxPacketSize 8
-	0x05 			// bInterval 5 (2^(5-1)=16 micro-frames)
+	REPLY_SIZE, 0x00,	// wMaxPacketSize 16
+	0x05, 			// bInterval 5 (2^(5-1)=16 micro-frames)
+
+	0x07,			// bLength
+	0x05,			// bDescriptorType (Endpoint)
+	0x01,			// bEndpointAddress (OUT/H2D)
+	0x03,			// bmAttributes (Interrupt)
+	OUT_PACKET_SIZE, 0x00,	// wMaxPacketSize 64
+	OUT_POLL_INTERVAL 	// bInterval 1 (1 ms)
 };
 
 static const uint8_t USB_ReportDescriptor[32] = {
@@ -148,7 +130,7 @@ static const uint8_t USB_ReportDescriptor[32] = {
 	0x15, 0x00,		// 	Logical Minimum (0)
 	0x25, 0xFF,		// 	Logical Maximum (255)
 	0x75, 0x08,		// 	Report Size (8)
-	0x95, 0x08,		// 	Report Count (8)
+	0x95, REPLY_SIZE,	// 	Report Count (16)
 	0x81, 0x02,		// 	Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
 	0x09, 0x03,		// 	Usage (0x03)
 	0x15, 0x00,		// 	Logical Minimum (0)
@@ -181,6 +163,27 @@ static const uint8_t USB_ProductStringDescriptor[] = {
 	'd', 0, 'e', 0, 'r', 0
 };
 
+#if WITH_SERIAL_NUMBER
+
+/* Serial number string: the 96-bit unique device ID, as 24 hex digits,
+ * built on request
+ */
+static uint16_t USB_SerialStringDescriptor[1 + 24];
+
+static void HIDUSB_SerialString(void)
+{
+	const uint32_t *uid = (const uint32_t *) UID_ADDRESS;
+	uint8_t nibble;
+
+	USB_SerialStringDescriptor[0] = 0x0300 | sizeof (USB_SerialStringDescriptor);
+	for (int i = 0; i < 24; i++) {
+		nibble = (uid[i / 8] >> (28 - 4 * (i % 8))) & 0x0F;
+		USB_SerialStringDescriptor[i + 1] = nibble < 10 ? '0' + nibble : 'A' - 10 + nibble;
+	}
+}
+
+#endif
+
 static void HIDUSB_GetDescriptor(USB_SetupPacket *setup_packet)
 {
 	uint16_t *descriptor = 0;
@@ -219,6 +222,14 @@ static void HIDUSB_GetDescriptor(USB_SetupPacket *setup_packet)
 			length = sizeof (USB_ProductStringDescriptor);
 			break;
 
+#if WITH_SERIAL_NUMBER
+		case 0x03:
+			HIDUSB_SerialString();
+			descriptor = USB_SerialStringDescriptor;
+			length = sizeof (USB_SerialStringDescriptor);
+			break;
+#endif
+
 		default:
 			break;
 		}
@@ -233,81 +244,81 @@ static void HIDUSB_GetDescriptor(USB_SetupPacket *setup_packet)
 	USB_SendData(0, descriptor, length);
 }
 
-static uint8_t HIDUSB_PacketIsCommand(void)
+/* Send the pending reply once EP1 is free, so that an armed reply is
+ * never overwritten. Called from the USB interrupt, or with it disabled.
+ */
+static void HIDUSB_SendPendingReply(void)
 {
-	size_t i;
+	uint16_t *reply;
 
-	for (i = 0; i < sizeof (Command) - 1; i++) {
-		if (PageData[i] != Command[i]) {
-			return 0xff;
+	if ((EP0REG[ENDP1] & EPTX_STAT) != EP_TX_VALID) {
+		reply = HIDUSB_TakeReply();
+		if (reply) {
+			USB_SendData(ENDP1, reply, REPLY_SIZE);
 		}
- 	}
-	for (i++; i < COMMAND_SIZE; i++) {
-		if (PageData[i]) {
-			return 0xff;
-		}
- 	}
-	return PageData[sizeof (Command) - 1];
+	}
 }
 
-static void HIDUSB_HandleData(uint8_t *data)
+void HIDUSB_FlashPages(void)
 {
-	uint16_t *page_address;
+	uint8_t endpoint;
 
-	memcpy(PageData + CurrentPageOffset, data, MAX_PACKET_SIZE);
-	CurrentPageOffset += MAX_PACKET_SIZE;
-	if (CurrentPageOffset == COMMAND_SIZE) {
-		switch (HIDUSB_PacketIsCommand()) {
-
-		case 0x00:
-
-			/* Reset Page Command */
-			UploadStarted = true;
-			CurrentPage = MIN_PAGE;
-			CurrentPageOffset = 0;
-		break;
-
-		case 0x01:
-
-			/* Reboot MCU Command */
-			UploadFinished = true;
-		break;
-
-		default:
-			break;
-		}
-	} else if (CurrentPageOffset >= PAGE_SIZE) {
+	while (HIDUSB_NextPage()) {
 		LED1_ON;
-		page_address = (uint16_t * ) (FLASH_BASE_ADDRESS +
-			(CurrentPage * PAGE_SIZE));
-		FLASH_WritePage(page_address, (uint16_t *) PageData,
-			PAGE_SIZE / 2);
-		CurrentPage++;
-		CurrentPageOffset = 0;
+		HIDUSB_WritePage();
 		LED1_OFF;
 	}
-  
-  if((CurrentPageOffset == 0)||(CurrentPageOffset == 1024)){
-    USB_SendData(ENDP1, (uint16_t *) Command,
-			sizeof (Command));
-  }
+
+	/* Both page buffers are free: resume the reception on the
+	 * endpoints where HIDUSB_HandleData() paused it
+	 */
+	NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+	for (endpoint = ENDP0; endpoint <= ENDP1; endpoint++) {
+		if ((EP0REG[endpoint] & EPRX_STAT) == EP_RX_NAK) {
+			SET_RX_STATUS(endpoint, EP_RX_VALID);
+		}
+	}
+
+	/* Send a command reply still pending, then acknowledge the
+	 * written pages once EP1 is free. The count is cumulative, so a
+	 * single reply may acknowledge several pages.
+	 */
+	HIDUSB_SendPendingReply();
+	if ((PagesAcknowledged != PagesWritten) &&
+		((EP0REG[ENDP1] & EPTX_STAT) != EP_TX_VALID)) {
+		PagesAcknowledged = PagesWritten;
+		HIDUSB_SendReply(CMD_PAGE_WRITTEN, PagesWritten, 0);
+		HIDUSB_SendPendingReply();
+	}
+	NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
 }
 
 void USB_Reset(void)
 {
 
-	/* Initialize Flash Page Settings */
-	CurrentPage = MIN_PAGE;
-	CurrentPageOffset = 0;
+	/* Initialize Flash Page Settings, unless an upload is in progress:
+	 * the host may resume it once the device is enumerated again
+	 */
+#if WITH_PROGRESS
+	if (UploadStarted) {
+		HIDUSB_AbortPage();
+	} else {
+		HIDUSB_ResetPages();
+	}
+#else
+	HIDUSB_ResetPages();
+#endif
 
 	/* Set buffer descriptor table offset in PMA memory */
 	WRITE_REG(*BTABLE, BTABLE_OFFSET);
 
-	/* Initialize Endpoint 0 */
+	/* Initialize Endpoint 0. SETUP packets are received even while
+	 * the OUT data is NAKed (see Endpoint 1).
+	 */
 	TOGGLE_REG(EP0REG[ENDP0],
 		   EP_DTOG_RX | EP_T_FIELD | EP_KIND | EP_DTOG_TX | EPTX_STAT | EPADDR_FIELD,
 		   0 | EP_CONTROL | 0,
-		   EP_RX_VALID);
+		   HIDUSB_CanReceive() ? EP_RX_VALID : EP_RX_NAK);
 
 	/* Set transmission buffer address for endpoint 0 in buffer descriptor table */
 	BTABLE_ADDR_FROM_OFFSET(ENDP0, BTABLE_OFFSET)[USB_ADDRn_TX] = ENDP0_TXADDR;
@@ -316,18 +327,25 @@ void USB_Reset(void)
 	BTABLE_ADDR_FROM_OFFSET(ENDP0, BTABLE_OFFSET)[USB_ADDRn_RX] = ENDP0_RXADDR;
 	RxTxBuffer[0].MaxPacketSize = MAX_PACKET_SIZE;
 
-	/* Initialize Endpoint 1 */
+	/* Initialize Endpoint 1. Reception stays paused if both page
+	 * buffers are still waiting to be written, until
+	 * HIDUSB_FlashPages() resumes it.
+	 */
 	TOGGLE_REG(EP0REG[ENDP1],
 		   EP_DTOG_RX | EP_T_FIELD | EP_KIND | EP_DTOG_TX | EPADDR_FIELD,
 		   1 | EP_INTERRUPT | 0,
-		   EP_RX_DIS | EP_TX_NAK);
+		   (HIDUSB_CanReceive() ? EP_RX_VALID : EP_RX_NAK) | EP_TX_NAK);
 
 	/* Set transmission buffer address for endpoint 1 in buffer descriptor table */
 	BTABLE_ADDR_FROM_OFFSET(ENDP1, BTABLE_OFFSET)[USB_ADDRn_TX] = ENDP1_TXADDR;
 
+	/* Set reception buffer address and size for endpoint 1 in buffer descriptor table */
+	BTABLE_ADDR_FROM_OFFSET(ENDP1, BTABLE_OFFSET)[USB_ADDRn_RX] = ENDP1_RXADDR;
+	BTABLE_ADDR_FROM_OFFSET(ENDP1, BTABLE_OFFSET)[USB_COUNTn_RX] = ENDP1_RXCOUNT;
+
 	/* Set transmission byte count for endpoint 1 in buffer descriptor table */
-	BTABLE_ADDR_FROM_OFFSET(ENDP1, BTABLE_OFFSET)[USB_COUNTn_TX] = MAX_PACKET_SIZE;
-	RxTxBuffer[1].MaxPacketSize = MAX_PACKET_SIZE;
+	BTABLE_ADDR_FROM_OFFSET(ENDP1, BTABLE_OFFSET)[USB_COUNTn_TX] = REPLY_SIZE;
+	RxTxBuffer[1].MaxPacketSize = REPLY_SIZE;
 
 	/* Clear device address and enable USB function */
 	WRITE_REG(*DADDR, DADDR_EF | 0);
@@ -338,6 +356,7 @@ void USB_EPHandler(uint16_t status)
 	uint8_t endpoint = READ_BIT(status, USB_ISTR_EP_ID);
 	uint16_t endpoint_status = EP0REG[endpoint];
 	USB_SetupPacket *setup_packet;
+	bool receive = true;
 
 	/* OUT and SETUP packets (data reception) */
 	if (READ_BIT(endpoint_status, EP_CTR_RX)) {
@@ -385,11 +404,28 @@ void USB_EPHandler(uint16_t status)
 			} else if (RxTxBuffer[endpoint].RXL) {
 
 				/* OUT packet */
-				HIDUSB_HandleData((uint8_t *) RxTxBuffer[endpoint].RXB);
+				HIDUSB_HandleData((uint8_t *) RxTxBuffer[endpoint].RXB,
+					RxTxBuffer[endpoint].RXL);
 			}
 
+			/* As on Endpoint 1, the OUT data is NAKed while
+			 * both page buffers are busy
+			 */
+			receive = HIDUSB_CanReceive();
+
+		} else if (RxTxBuffer[endpoint].RXL == OUT_PACKET_SIZE) {
+
+			/* Interrupt OUT report. While both page buffers are
+			 * busy, the endpoint NAKs until HIDUSB_FlashPages()
+			 * resumes the reception.
+			 */
+			receive = HIDUSB_HandleData(
+				(uint8_t *) RxTxBuffer[endpoint].RXB,
+				OUT_PACKET_SIZE);
+		}
+		if (receive) {
+			SET_RX_STATUS(endpoint, EP_RX_VALID);
 		}
-		SET_RX_STATUS(endpoint, EP_RX_VALID);
 	}
 	if (READ_BIT(endpoint_status, EP_CTR_TX)) {
 
@@ -403,4 +439,9 @@ void USB_EPHandler(uint16_t status)
 		USB_Buffer2PMA(endpoint);
 		SET_TX_STATUS(endpoint, (endpoint == ENDP1) ? EP_TX_NAK : EP_TX_VALID);
 	}
+
+	/* Reply to a command just received, or that waited for the
+	 * previous reply to be sent
+	 */
+	HIDUSB_SendPendingReply();
 }
@@ -78,6 +78,9 @@ static void delay(uint32_t timeout)
 
 static bool check_flash_complete(void)
 {
+
+	/* Program the pages received so far */
+	HIDUSB_FlashPages();
 	if (UploadFinished == true) {
 		return true;
 	}
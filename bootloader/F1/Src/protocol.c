@@ -0,0 +1,416 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+* Copyright (c) 2018 Bruno Freitas - bruno@brunofreitas.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* Protocol and page assembly, split from hid.c: no register access here,
+* so that it also builds for the host (see bootloader/host)
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include "usb.h"
+#include "hid.h"
+#include "flash.h"
+#include "protocol.h"
+
+/* Host pages erased together */
+#define ERASE_PAGES		(PAGE_SIZE / HOST_PAGE_SIZE)
+
+/* Command size, and size of its signature, code and arguments */
+#define COMMAND_SIZE		64
+#define COMMAND_HEADER_SIZE	16
+
+/* Protocol version reported by the <get info> command */
+#define PROTOCOL_VERSION	1
+
+/* Number of pages the host may send ahead of the page acknowledges */
+#define PAGE_WINDOW		2
+
+/* <get info> capability flags */
+#define CAP_PAGE_CRC		0x0001
+#define CAP_VERIFY		0x0002
+#define CAP_BLANK_CHIP		0x0004
+#define CAP_PROGRESS		0x0040
+
+/* Capabilities of this build (see the Makefile) */
+#define CAPABILITIES		(CAP_BLANK_CHIP | \
+	(WITH_PAGE_CRC ? CAP_PAGE_CRC | CAP_VERIFY : 0) | \
+	(WITH_PROGRESS ? CAP_PROGRESS : 0))
+
+/* <reset pages> flags */
+#define RESET_BLANK_CHIP	0x01
+
+/* Upload started flag */
+volatile bool UploadStarted;
+
+/* Upload finished flag */
+volatile bool UploadFinished;
+
+/* Received command signature (command code follows) */
+static const uint8_t Command[] = {'B', 'T', 'L', 'D', 'C', 'M', 'D'};
+
+/* Sent reply: command signature, reply code and two 32-bit arguments */
+static uint8_t Reply[REPLY_SIZE] __attribute__ ((aligned (2))) =
+	{'B', 'T', 'L', 'D', 'C', 'M', 'D'};
+
+/* The reply waits for EP1 to be free (see HIDUSB_TakeReply()) */
+static volatile bool ReplyPending;
+
+/* Double-buffered page data: USB fills one page while the main loop
+ * programs the other one
+ */
+static uint8_t PageData[2][HOST_PAGE_SIZE];
+
+/* Page number of each buffer, <reset pages> count when it was received,
+ * and whether it is waiting to be written
+ */
+static volatile uint16_t PageNumber[2];
+static volatile uint8_t PageResets[2];
+static volatile bool PageReady[2];
+
+/* Buffers currently filled by USB and programmed by the main loop. They
+ * are never reset, so that they stay in step.
+ */
+static volatile uint8_t ReceiveBuffer;
+static volatile uint8_t WriteBuffer;
+
+/* <reset pages> received by USB, and applied by the main loop: the main
+ * loop owns the page counts, USB only requests their reset
+ */
+static volatile uint8_t Resets;
+static uint8_t ResetsApplied;
+
+/* Pages written since <reset pages>, and last count acknowledged */
+volatile uint16_t PagesWritten;
+uint16_t PagesAcknowledged;
+
+/* The host declared the chip blank, pages are not erased */
+static bool ChipIsBlank;
+
+/* Last Flash page erased (in ERASE_PAGES units): a Flash page is erased
+ * when the first page inside it is written, the host may skip the others
+ */
+static uint16_t ErasedPage;
+
+#if WITH_PROGRESS
+/* Page after the last one written since <reset pages> (counted from
+ * MIN_PAGE), 0 if none: where an interrupted upload resumes
+ */
+static volatile uint16_t WrittenPage;
+#endif
+
+/* Current page number (starts right after bootloader's end) */
+static volatile uint16_t CurrentPage;
+
+/* Byte offset in flash page */
+static volatile uint16_t CurrentPageOffset;
+
+static uint8_t HIDUSB_PacketIsCommand(uint8_t *data)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof (Command); i++) {
+		if (data[i] != Command[i]) {
+			return 0xff;
+		}
+ 	}
+	for (i = COMMAND_HEADER_SIZE; i < COMMAND_SIZE; i++) {
+		if (data[i]) {
+			return 0xff;
+		}
+ 	}
+	return data[sizeof (Command)];
+}
+
+/* Queue a reply. The host waits for the reply to a command before it
+ * sends the next one, and the page acknowledges are only queued when no
+ * reply is pending, so a single one is pending at most.
+ */
+void HIDUSB_SendReply(uint8_t code, uint32_t arg0, uint32_t arg1)
+{
+	Reply[7] = code;
+	memcpy(Reply + 8, &arg0, sizeof (arg0));
+	memcpy(Reply + 12, &arg1, sizeof (arg1));
+	ReplyPending = true;
+}
+
+/* Returns the pending reply and clears it, NULL if none */
+uint16_t *HIDUSB_TakeReply(void)
+{
+	if (!ReplyPending) {
+		return NULL;
+	}
+	ReplyPending = false;
+	return (uint16_t *) Reply;
+}
+
+#if WITH_PAGE_CRC
+
+/* Reply with the CRC32 of <count> pages from <first> (counted from the
+ * first page after the bootloader), extended to whole Flash pages so that
+ * the host knows which pages are erased together. Pages past the end of
+ * the Flash memory are left out.
+ */
+static void HIDUSB_SendPagesCRC(uint16_t first, uint16_t count)
+{
+	uint16_t flash_pages = *(uint16_t *) FLASH_SIZE_ADDRESS;
+	uint16_t start, end;
+
+	start = (MIN_PAGE + first) & ~(ERASE_PAGES - 1);
+	end = (MIN_PAGE + first + (count ? count : 1) + ERASE_PAGES - 1) &
+		~(ERASE_PAGES - 1);
+	if (end > flash_pages) {
+		end = flash_pages;
+	}
+	if (start > end) {
+		start = end;
+	}
+	HIDUSB_SendReply(CMD_GET_CRC,
+		FLASH_CRC((uint32_t *) (FLASH_BASE_ADDRESS +
+			(start * HOST_PAGE_SIZE)),
+			(end - start) * (HOST_PAGE_SIZE / 4)),
+		(start - MIN_PAGE) | ((end - start) << 16));
+}
+
+/* Reply with the CRC32 of the <size> first bytes after the bootloader,
+ * rounded up to whole words
+ */
+static void HIDUSB_SendImageCRC(uint32_t size)
+{
+	uint32_t max_size = (*(uint16_t *) FLASH_SIZE_ADDRESS - MIN_PAGE) *
+		HOST_PAGE_SIZE;
+
+	if (size > max_size) {
+		size = max_size;
+	}
+	HIDUSB_SendReply(CMD_VERIFY,
+		FLASH_CRC((uint32_t *) (FLASH_BASE_ADDRESS +
+			(MIN_PAGE * HOST_PAGE_SIZE)), (size + 3) / 4),
+		size);
+}
+
+#endif
+
+/* Restart the reception at MIN_PAGE. The main loop may be programming a
+ * page: it resets the page counts and drops the pages received so far
+ * before the next write (see HIDUSB_NextPage()).
+ */
+void HIDUSB_ResetPages(void)
+{
+	CurrentPage = MIN_PAGE;
+	CurrentPageOffset = 0;
+	Resets++;
+}
+
+#if WITH_PROGRESS
+
+/* Drop the page being received, keep the pages written so far: the host
+ * resumes the upload after a USB reset (link drop and enumeration)
+ */
+void HIDUSB_AbortPage(void)
+{
+	CurrentPageOffset = 0;
+}
+
+#endif
+
+/* Returns false when the next report would land in a buffer that is still
+ * waiting to be written (see HIDUSB_CanReceive()): reception must pause
+ * until HIDUSB_NextPage() returns false.
+ */
+bool HIDUSB_HandleData(uint8_t *data, uint8_t length)
+{
+	uint8_t *page_data = PageData[ReceiveBuffer];
+	uint32_t page;
+
+	/* Drop a report that does not fit in the page buffer, if 8-byte
+	 * EP0 and 64-byte EP1 packets are mixed within a page
+	 */
+	if (length > HOST_PAGE_SIZE - CurrentPageOffset) {
+		return HIDUSB_CanReceive();
+	}
+	memcpy(page_data + CurrentPageOffset, data, length);
+	CurrentPageOffset += length;
+	if (CurrentPageOffset == COMMAND_SIZE) {
+		switch (HIDUSB_PacketIsCommand(page_data)) {
+
+		case CMD_RESET_PAGES:
+
+			/* Reset Page Command */
+			UploadStarted = true;
+			HIDUSB_ResetPages();
+			ChipIsBlank = page_data[8] & RESET_BLANK_CHIP;
+		break;
+
+		case CMD_REBOOT_MCU:
+
+			/* Reboot MCU Command */
+			UploadFinished = true;
+			CurrentPageOffset = 0;
+		break;
+
+		case CMD_GET_INFO:
+
+			/* Get Info Command: protocol version, page window,
+			 * Flash page size, capabilities and OUT endpoint
+			 * polling interval
+			 */
+			HIDUSB_SendReply(CMD_GET_INFO, PROTOCOL_VERSION |
+				(PAGE_WINDOW << 8) | (PAGE_SIZE << 16),
+				CAPABILITIES | (OUT_POLL_INTERVAL << 16));
+			CurrentPageOffset = 0;
+		break;
+
+#if WITH_PAGE_CRC
+		case CMD_GET_CRC:
+
+			/* Get CRC Command: first page and page count */
+			HIDUSB_SendPagesCRC(page_data[8] | (page_data[9] << 8),
+				page_data[12] | (page_data[13] << 8));
+			CurrentPageOffset = 0;
+		break;
+
+		case CMD_VERIFY:
+
+			/* Verify Command: image size in bytes */
+			HIDUSB_SendImageCRC(page_data[8] |
+				(page_data[9] << 8) | (page_data[10] << 16) |
+				((uint32_t) page_data[11] << 24));
+			CurrentPageOffset = 0;
+		break;
+#endif
+
+#if WITH_PROGRESS
+		case CMD_GET_PROGRESS:
+
+			/* Get Progress Command: pages written since <reset
+			 * pages>, and the page after the last one, so that
+			 * the host resumes there after a USB link drop
+			 */
+			HIDUSB_SendReply(CMD_GET_PROGRESS, PagesWritten,
+				WrittenPage);
+			CurrentPageOffset = 0;
+		break;
+#endif
+
+		case CMD_SET_PAGE:
+
+			/* Set Page Command: the next page is written at
+			 * the given page, to skip unchanged pages. A page
+			 * outside of the Flash memory is ignored.
+			 */
+			page = MIN_PAGE + (page_data[8] | (page_data[9] << 8));
+			if (page < *(uint16_t *) FLASH_SIZE_ADDRESS) {
+				CurrentPage = page;
+			}
+			CurrentPageOffset = 0;
+		break;
+
+		case 0xff:
+
+			/* Page data */
+			break;
+
+		default:
+
+			/* Unknown command, ignore it */
+			CurrentPageOffset = 0;
+			break;
+		}
+	} else if (CurrentPageOffset >= HOST_PAGE_SIZE) {
+
+		/* Hand the page over to the main loop, and switch to the
+		 * other buffer. The host never sends more than PAGE_WINDOW
+		 * pages ahead of the acknowledges, and reception pauses
+		 * while the other buffer is not written yet. A page past
+		 * the end of the Flash memory is dropped.
+		 */
+		if (CurrentPage < *(uint16_t *) FLASH_SIZE_ADDRESS) {
+			PageNumber[ReceiveBuffer] = CurrentPage;
+			PageResets[ReceiveBuffer] = Resets;
+			PageReady[ReceiveBuffer] = true;
+			ReceiveBuffer ^= 1;
+		}
+		CurrentPage++;
+		CurrentPageOffset = 0;
+	}
+	return HIDUSB_CanReceive();
+}
+
+/* Whether the buffer the next report lands in is free */
+bool HIDUSB_CanReceive(void)
+{
+	return !PageReady[ReceiveBuffer];
+}
+
+/* Apply the last <reset pages>, and drop the pages received before it.
+ * Returns whether a page is ready for HIDUSB_WritePage().
+ */
+bool HIDUSB_NextPage(void)
+{
+	bool ready;
+	uint8_t resets;
+
+	for (;;) {
+
+		/* A page seen ready was received before this count */
+		ready = PageReady[WriteBuffer];
+		resets = Resets;
+		if (resets != ResetsApplied) {
+			ResetsApplied = resets;
+			PagesWritten = PagesAcknowledged = 0;
+			ErasedPage = 0;
+#if WITH_PROGRESS
+			WrittenPage = 0;
+#endif
+		}
+		if (!ready) {
+			return false;
+		}
+		if (PageResets[WriteBuffer] == resets) {
+			return true;
+		}
+		PageReady[WriteBuffer] = false;
+		WriteBuffer ^= 1;
+	}
+}
+
+/* Program the next page handed over by HIDUSB_HandleData(), once
+ * HIDUSB_NextPage() returned true
+ */
+void HIDUSB_WritePage(void)
+{
+	uint16_t *page_address;
+	uint16_t erase_page;
+
+	page_address = (uint16_t *) (FLASH_BASE_ADDRESS +
+		(PageNumber[WriteBuffer] * HOST_PAGE_SIZE));
+	erase_page = PageNumber[WriteBuffer] / ERASE_PAGES;
+	FLASH_WritePage(page_address,
+		(uint16_t *) PageData[WriteBuffer],
+		HOST_PAGE_SIZE / 2,
+		!ChipIsBlank && (erase_page != ErasedPage));
+	ErasedPage = erase_page;
+#if WITH_PROGRESS
+	WrittenPage = PageNumber[WriteBuffer] - MIN_PAGE + 1;
+#endif
+	PageReady[WriteBuffer] = false;
+	WriteBuffer ^= 1;
+	PagesWritten++;
+}
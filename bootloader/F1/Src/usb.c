@@ -44,7 +44,8 @@ void USB_PMA2Buffer(uint8_t endpoint)
 	uint32_t *address = (uint32_t *) (PMAAddr + btable[USB_ADDRn_RX] * 2);
 	uint16_t *destination = (uint16_t *) RxTxBuffer[endpoint].RXB;
 
-	for (uint32_t i = 0; i < count; i++) {
+	/* PMA is organized as 16-bit half-words at 32-bit boundaries */
+	for (uint32_t i = (count + 1) / 2; i; i--) {
 		*destination++ = *address++;
 	}
 }
@@ -0,0 +1,19 @@
+/*******************************************************************************
+  *
+  * HID bootloader for STM32F407 MCU
+  *
+  ******************************************************************************
+  * @file           : lz4.h
+  * @brief          : LZ4 block decoder
+  ******************************************************************************
+  */
+
+#ifndef __LZ4_H__
+#define __LZ4_H__
+
+#include <stdint.h>
+
+uint32_t lz4_decompress(const uint8_t *src, uint32_t src_len,
+                        uint8_t *dst, uint32_t dst_len);
+
+#endif /* __LZ4_H__ */
@@ -72,6 +72,7 @@
 /* Includes ------------------------------------------------------------------*/
 
 /* USER CODE BEGIN Includes */
+#include <stdint.h>
 
 /* USER CODE END Includes */
 
@@ -88,7 +89,58 @@
 #define USER_CODE_OFFSET  0x4000 //<USER CODE> flash start address.
 
 #define SECTOR_SIZE   1024
+
+/* Supply voltage range of the board. It sets the flash erase and program
+   parallelism: x32 from 2.7 V to 3.6 V (FLASH_VOLTAGE_RANGE_3), x64 with
+   an external Vpp (FLASH_VOLTAGE_RANGE_4) */
+#define FLASH_VOLTAGE_RANGE  FLASH_VOLTAGE_RANGE_3
+
+/* Flash status errors that fail a page write */
+#define FLASH_PROGRAM_ERRORS  (FLASH_FLAG_PGSERR | FLASH_FLAG_PGPERR | \
+                               FLASH_FLAG_PGAERR | FLASH_FLAG_WRPERR)
+
 #define HID_RX_SIZE   64
+#define HID_TX_SIZE   CUSTOM_HID_EPIN_SIZE
+
+/* Protocol version reported by the <get info> command */
+#define PROTOCOL_VERSION  1
+
+/* Number of pages the host may send ahead of the page acknowledges */
+#define PAGE_WINDOW       8
+
+/* Commands */
+#define CMD_RESET_PAGES   0x00
+#define CMD_REBOOT_MCU    0x01
+#define CMD_PAGE_WRITTEN  0x02
+#define CMD_GET_INFO      0x03
+#define CMD_GET_CRC       0x04
+#define CMD_SET_PAGE      0x05
+#define CMD_VERIFY        0x06
+#define CMD_ERASING       0x07 // Reply only: erase time left
+#define CMD_ERASE         0x08
+#define CMD_GET_PROGRESS  0x09
+
+/* <get info> capability flags */
+#define CAP_PAGE_CRC      0x0001
+#define CAP_VERIFY        0x0002
+#define CAP_LZ4           0x0008
+#define CAP_ERASE_AHEAD   0x0010 // <reset pages> takes the image size
+#define CAP_ERASE         0x0020 // <erase> command
+#define CAP_PROGRESS      0x0040 // <get progress> command
+
+/* <reset pages> flags */
+#define RESET_LZ4         0x02 // Pages are LZ4 compressed
+
+/* A compressed page is sent as its LZ4 block length (LE16, at most
+   LZ4_MAX_BLOCK), then the LZ4 block, padded to whole reports. A page
+   that does not compress to fewer reports is sent as is, without a
+   length, unless its first 2 bytes read as a block length: it is then
+   preceded by a 0 length, and takes one more report. It is received in
+   pageData, and decompressed into flashData before it is programmed:
+   decompression needs 1 kB of RAM, plus 64 bytes per page buffer for the
+   length and padding. */
+#define LZ4_HEADER_SIZE   2
+#define LZ4_MAX_BLOCK     (SECTOR_SIZE - LZ4_HEADER_SIZE - 1)
 
 #define HID_MAGIC_NUMBER_BKP_INDEX LL_RTC_BKP_DR4
 #define HID_MAGIC_NUMBER_BKP_VALUE 0x424C
@@ -125,6 +177,7 @@
  extern "C" {
 #endif
 void _Error_Handler(char *, int);
+uint8_t HID_ReportReceived(uint8_t *report);
 
 #define Error_Handler() _Error_Handler(__FILE__, __LINE__)
 #ifdef __cplusplus
@@ -0,0 +1,39 @@
+/*******************************************************************************
+  *
+  * HID bootloader for STM32F407 MCU
+  *
+  ******************************************************************************
+  * @file           : protocol.h
+  * @brief          : Report queue, command parser and page assembly
+  ******************************************************************************
+  */
+
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+#include <stdint.h>
+
+/* Flash memory base address, and flash size register (in kB). The host
+   build of the protocol (see bootloader/host) points them to a simulated
+   flash memory */
+#ifndef FLASH_BASE
+#define FLASH_BASE      0x08000000U
+#endif
+#ifndef FLASHSIZE_BASE
+#define FLASHSIZE_BASE  0x1FFF7A22U
+#endif
+
+/* Set once the <reboot> command is processed */
+extern uint8_t reboot_requested;
+
+void protocol_task(void);
+
+/* Implemented by the platform: main.c, or the host harness */
+extern const uint8_t out_poll_interval;
+uint8_t send_reply(uint8_t code, uint32_t arg0, uint32_t arg1);
+uint8_t write_flash_sector(uint32_t page, const uint32_t *data);
+void erase_sector(uint32_t sector);
+uint32_t flash_crc(const uint32_t *address, uint32_t words);
+void resume_reception(void);
+
+#endif /* __PROTOCOL_H__ */
@@ -50,7 +50,13 @@
   * @{
   */ 
 #define CUSTOM_HID_EPIN_ADDR                 0x81
-#define CUSTOM_HID_EPIN_SIZE                 8
+#ifdef HID_HIGH_THROUGHPUT
+#define CUSTOM_HID_EPIN_SIZE                 64
+#define CUSTOM_HID_FS_BINTERVAL              0x01
+#else
+#define CUSTOM_HID_EPIN_SIZE                 16
+#define CUSTOM_HID_FS_BINTERVAL              0x20
+#endif
 
 #define CUSTOM_HID_EPOUT_ADDR                0x01
 #define CUSTOM_HID_EPOUT_SIZE                64
@@ -135,6 +141,8 @@ uint8_t USBD_CUSTOM_HID_SendReport (USBD_HandleTypeDef *pdev,
                                  uint8_t *report,
                                  uint16_t len);
 
+uint8_t USBD_CUSTOM_HID_ReceivePacket (USBD_HandleTypeDef *pdev);
+
 
 
 uint8_t  USBD_CUSTOM_HID_RegisterInterface  (USBD_HandleTypeDef   *pdev, 
@@ -178,16 +178,16 @@ __ALIGN_BEGIN static uint8_t USBD_CUSTOM_HID_CfgDesc[USB_CUSTOM_HID_CONFIG_DESC_
   USBD_EP_TYPE_INTR,          /*bmAttributes: Interrupt endpoint*/
   CUSTOM_HID_EPIN_SIZE, /*wMaxPacketSize: 2 Byte max */
   0x00,
-  0x20,          /*bInterval: Polling Interval (20 ms)*/
+  CUSTOM_HID_FS_BINTERVAL, /*bInterval: Polling Interval */
   /* 34 */
   
   0x07,	         /* bLength: Endpoint Descriptor size */
   USB_DESC_TYPE_ENDPOINT,	/* bDescriptorType: */
   CUSTOM_HID_EPOUT_ADDR,  /*bEndpointAddress: Endpoint Address (OUT)*/
-  USBD_EP_TYPE_ISOC,	/* bmAttributes: Interrupt endpoint */
+  USBD_EP_TYPE_INTR,	/* bmAttributes: Interrupt endpoint */
   CUSTOM_HID_EPOUT_SIZE,	/* wMaxPacketSize: 2 Bytes max  */
   0x00,
-  0x20,	/* bInterval: Polling Interval (20 ms) */
+  CUSTOM_HID_FS_BINTERVAL,	/* bInterval: Polling Interval */
   /* 41 */
 } ;
 
@@ -459,12 +459,35 @@ static uint8_t  USBD_CUSTOM_HID_DataOut (USBD_HandleTypeDef *pdev,
   
   USBD_CUSTOM_HID_HandleTypeDef     *hhid = (USBD_CUSTOM_HID_HandleTypeDef*)pdev->pClassData;  
   
-  ((USBD_CUSTOM_HID_ItfTypeDef *)pdev->pUserData)->OutEvent(hhid->Report_buf[0], 
-                                                            hhid->Report_buf[1]);
-    
+  /* The endpoint NAKs the next reports until USBD_CUSTOM_HID_ReceivePacket()
+     is called if the application can't take them yet */
+  if (((USBD_CUSTOM_HID_ItfTypeDef *)pdev->pUserData)->OutEvent(hhid->Report_buf[0], 
+                                                                hhid->Report_buf[1]) == USBD_OK)
+  {
+    USBD_LL_PrepareReceive(pdev, CUSTOM_HID_EPOUT_ADDR , hhid->Report_buf, 
+                           USBD_CUSTOMHID_OUTREPORT_BUF_SIZE);
+  }
+
+  return USBD_OK;
+}
+
+/**
+  * @brief  USBD_CUSTOM_HID_ReceivePacket
+  *         Prepare OUT Endpoint for reception, after OutEvent refused
+  *         the next report
+  * @param  pdev: device instance
+  * @retval status
+  */
+uint8_t USBD_CUSTOM_HID_ReceivePacket(USBD_HandleTypeDef *pdev)
+{
+  USBD_CUSTOM_HID_HandleTypeDef     *hhid = (USBD_CUSTOM_HID_HandleTypeDef*)pdev->pClassData;
+
+  if (pdev->dev_state != USBD_STATE_CONFIGURED)
+  {
+    return USBD_FAIL;
+  }
   USBD_LL_PrepareReceive(pdev, CUSTOM_HID_EPOUT_ADDR , hhid->Report_buf, 
                          USBD_CUSTOMHID_OUTREPORT_BUF_SIZE);
-
   return USBD_OK;
 }
 
@@ -0,0 +1,86 @@
+/*******************************************************************************
+  *
+  * HID bootloader for STM32F407 MCU
+  *
+  ******************************************************************************
+  * @file           : lz4.c
+  * @brief          : LZ4 block decoder
+  ******************************************************************************
+  * Decodes one LZ4 block (no frame header, no checksum). Matches may only
+  * refer to data already decoded into <dst>, so the output buffer is the
+  * whole window: no RAM is needed besides the input and output buffers and
+  * a few words of stack.
+  ******************************************************************************
+  */
+
+#include <string.h>
+#include "lz4.h"
+
+/* Add the length extension bytes to <len>. Returns 0 past the end of
+   the input. */
+static int lz4_length(const uint8_t **ip, const uint8_t *end, uint32_t *len)
+{
+  uint8_t byte;
+
+  do {
+    if (*ip >= end) {
+      return 0;
+    }
+    byte = *(*ip)++;
+    *len += byte;
+  } while (byte == 255);
+  return 1;
+}
+
+/* Returns the decompressed size, or 0 if the block is malformed or does
+   not fit in <dst_len> bytes */
+uint32_t lz4_decompress(const uint8_t *src, uint32_t src_len,
+                        uint8_t *dst, uint32_t dst_len)
+{
+  const uint8_t *ip = src;
+  const uint8_t *end = src + src_len;
+  uint8_t *op = dst;
+  uint8_t *op_end = dst + dst_len;
+  uint32_t len, offset;
+  uint8_t token;
+
+  while (ip < end) {
+    token = *ip++;
+
+    /* Literals */
+    len = token >> 4;
+    if ((len == 15) && !lz4_length(&ip, end, &len)) {
+      return 0;
+    }
+    if ((len > (uint32_t) (end - ip)) || (len > (uint32_t) (op_end - op))) {
+      return 0;
+    }
+    memcpy(op, ip, len);
+    op += len;
+    ip += len;
+
+    /* The last sequence has no match */
+    if (ip == end) {
+      break;
+    }
+
+    /* Match, that may overlap the bytes it produces */
+    if ((end - ip) < 2) {
+      return 0;
+    }
+    offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    len = (token & 15) + 4;
+    if (((token & 15) == 15) && !lz4_length(&ip, end, &len)) {
+      return 0;
+    }
+    if ((offset == 0) || (offset > (uint32_t) (op - dst)) ||
+        (len > (uint32_t) (op_end - op))) {
+      return 0;
+    }
+    for (; len > 0; len--, op++) {
+      *op = *(op - offset);
+    }
+  }
+  return op - dst;
+}
@@ -65,6 +65,8 @@
 #include "stm32f4xx_ll_rtc.h"
 #include "stm32f4xx_ll_pwr.h"
 /* USER CODE BEGIN Includes */
+#include "usbd_customhid.h"
+#include "protocol.h"
 
 /* USER CODE END Includes	*/
 
@@ -73,18 +75,15 @@
 /* USER CODE BEGIN PV */
 /* Private variables ---------------------------------------------------------*/
 
-uint8_t USB_RX_Buffer[HID_RX_SIZE];
-uint8_t USB_TX_Buffer[8]; //USB data -> PC
+uint8_t USB_TX_Buffer[HID_TX_SIZE]; //USB data -> PC
 static uint8_t CMD_SIGNATURE[7] = {'B','T','L','D','C','M','D'};
 
-/* Command: <Send next data pack> */
-static uint8_t CMD_DATA_RECEIVED[8] = {'B','T','L','D','C','M','D',2};
-uint8_t new_data_is_received = 0;
-static uint8_t pageData[SECTOR_SIZE];
+/* OUT endpoint polling interval, reported by the <get info> command */
+const uint8_t out_poll_interval = CUSTOM_HID_FS_BINTERVAL;
+
 typedef void (*funct_ptr)(void);
 
 uint32_t magic_val;
-uint16_t erase_page = 1;
 
 /* USER CODE END PV */
 
@@ -94,8 +93,6 @@ static void MX_GPIO_Init(void);
 
 /* USER CODE BEGIN PFP */
 /* Private function prototypes -----------------------------------------------*/
-void write_flash_sector(uint32_t currentPage);
-extern uint8_t USBD_CUSTOM_HID_SendReport(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len);
 
 /* USER CODE END PFP */
 
@@ -168,54 +165,20 @@ int main(void)
   MX_USB_DEVICE_Init();
 
   /* USER CODE BEGIN 2 */
-                                               
-  static volatile uint32_t current_Page = (USER_CODE_OFFSET / 1024);
-  static volatile uint16_t currentPageOffset = 0;
-                                                           
+
   /* USER CODE END 2 */
 
   /* Infinite loop */
   /* USER CODE BEGIN WHILE */
   while (1) {
-    if (new_data_is_received == 1) {
-      new_data_is_received = 0;
-      if (memcmp(USB_RX_Buffer, CMD_SIGNATURE, sizeof (CMD_SIGNATURE)) == 0) {
-        switch(USB_RX_Buffer[7]){
-          case 0x00:
-
-          /*------------ Reset pages */
-          current_Page = 16;
-          currentPageOffset = 0;
-          erase_page = 1;
-          // HAL_GPIO_TogglePin(GPIOE, GPIO_PIN_0);	
-          break;
-
-        case 0x01:
-
-          /*------------- Reset MCU */
-          if (currentPageOffset > 0) {
-
-          /* There are incoming
-             data that are less
-             than sector size
-             (16384) */
-            write_flash_sector(current_Page);
-          }
-          HAL_Delay(100);
-          HAL_NVIC_SystemReset();
-          break;
-        }
-      } else {
-        memcpy(pageData + currentPageOffset, USB_RX_Buffer, HID_RX_SIZE);
-        currentPageOffset += HID_RX_SIZE;
-        if (currentPageOffset == SECTOR_SIZE) {
-          write_flash_sector(current_Page);
-          current_Page++;
-          currentPageOffset = 0;
-          CMD_DATA_RECEIVED[7] = 0x02;
-          USBD_CUSTOM_HID_SendReport(&hUsbDeviceFS, CMD_DATA_RECEIVED, 8);
-        }
-      }
+
+    protocol_task();
+
+    if (reboot_requested) {
+
+      /*------------- Reset MCU */
+      HAL_Delay(100);
+      HAL_NVIC_SystemReset();
     }
   }
 
@@ -326,12 +289,67 @@ static void MX_GPIO_Init(void)
 }
 
 /* USER CODE BEGIN 4 */
-void write_flash_sector(uint32_t currentPage) {
-  uint32_t pageAddress = FLASH_BASE + (currentPage * SECTOR_SIZE);
+
+/* Send a reply to the host: command signature, reply code and two
+   32-bit arguments. Returns 0 if the previous one is still pending. */
+uint8_t send_reply(uint8_t code, uint32_t arg0, uint32_t arg1)
+{
+  USBD_CUSTOM_HID_HandleTypeDef *hhid = (USBD_CUSTOM_HID_HandleTypeDef *) hUsbDeviceFS.pClassData;
+
+  if ((hhid == NULL) || (hhid->state != CUSTOM_HID_IDLE)) {
+    return 0;
+  }
+  memcpy(USB_TX_Buffer, CMD_SIGNATURE, sizeof (CMD_SIGNATURE));
+  USB_TX_Buffer[7] = code;
+  memcpy(USB_TX_Buffer + 8, &arg0, sizeof (arg0));
+  memcpy(USB_TX_Buffer + 12, &arg1, sizeof (arg1));
+  USBD_CUSTOM_HID_SendReport(&hUsbDeviceFS, USB_TX_Buffer, HID_TX_SIZE);
+  return 1;
+}
+
+/* CRC32 (Ethernet polynomial) of flash words, computed by the CRC unit */
+uint32_t flash_crc(const uint32_t *address, uint32_t words)
+{
+  __HAL_RCC_CRC_CLK_ENABLE();
+  CRC->CR = CRC_CR_RESET;
+  while (words--) {
+    CRC->DR = *address++;
+  }
+  return CRC->DR;
+}
+
+/* Re-arm the OUT endpoint once the queue has room again */
+void resume_reception(void)
+{
+  HAL_NVIC_DisableIRQ(OTG_FS_IRQn);
+  USBD_CUSTOM_HID_ReceivePacket(&hUsbDeviceFS);
+  HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
+}
+
+/* Erase a flash sector */
+void erase_sector(uint32_t sector)
+{
+  FLASH_EraseInitTypeDef EraseInit;
   uint32_t SectorError;
 
+  HAL_GPIO_WritePin(LED_1_PORT, LED_1_PIN, GPIO_PIN_SET);
+  HAL_FLASH_Unlock();
+  EraseInit.TypeErase = FLASH_TYPEERASE_SECTORS;
+  EraseInit.VoltageRange  = FLASH_VOLTAGE_RANGE;
+  EraseInit.Sector = sector;
+  EraseInit.NbSectors = 1;
+  HAL_FLASHEx_Erase(&EraseInit, &SectorError);
+  HAL_FLASH_Lock();
+  HAL_GPIO_WritePin(LED_1_PORT, LED_1_PIN, GPIO_PIN_RESET);
+}
+
+/* Program a page. Returns 0 if the flash reported a programming error,
+   the page is then not acknowledged and the host sends it again */
+uint8_t write_flash_sector(uint32_t currentPage, const uint32_t *data) {
+  volatile uint32_t *pageAddress = (uint32_t *) (FLASH_BASE + (currentPage * SECTOR_SIZE));
+  uint32_t errors = 0;
+
   HAL_GPIO_WritePin(LED_1_PORT, LED_1_PIN, GPIO_PIN_SET);	
-  FLASH_EraseInitTypeDef EraseInit;
   HAL_FLASH_Unlock();
   
                                                                    
@@ -341,36 +359,44 @@ void write_flash_sector(uint32_t currentPage) {
                                                 
                                                  
 
-  /* Sector to the erase the flash memory (16, 32, 48 ... kbytes) */
-  if ((currentPage == 16) || (currentPage == 32) ||
-      (currentPage == 48) || (currentPage == 64) ||
-      (currentPage % 128 == 0)) {
-    EraseInit.TypeErase = FLASH_TYPEERASE_SECTORS;
-    EraseInit.VoltageRange  = FLASH_VOLTAGE_RANGE_3;
-
-    /* Specify sector number. Starts from 0x08004000 */
-    EraseInit.Sector = erase_page++;
-                                              
-  
-
-    /* This is also important! */
-    EraseInit.NbSectors = 1;
-    HAL_FLASHEx_Erase(&EraseInit, &SectorError);
+  /* Program the page straight from the word-aligned buffer, without the
+     HAL per-word overhead: set the parallelism once, then write and
+     wait for each word (or double word), and stop at the first error.
+     As FLASH_Program_DoubleWord(), the two halves of a double word are
+     kept in order by a barrier. */
+  while (FLASH->SR & FLASH_SR_BSY) {
+    ;
   }
-
-  uint32_t dat;
-  for (int i = 0; i < SECTOR_SIZE; i += 4) {
-    dat = pageData[i+3];
-    dat <<= 8;
-    dat += pageData[i+2];
-    dat <<= 8;
-    dat += pageData[i+1];
-    dat <<= 8;
-    dat += pageData[i];
-    HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, pageAddress + i, dat);
+  __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR |
+                         FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+  CLEAR_BIT(FLASH->CR, FLASH_CR_PSIZE);
+#if FLASH_VOLTAGE_RANGE == FLASH_VOLTAGE_RANGE_4
+  FLASH->CR |= FLASH_PSIZE_DOUBLE_WORD | FLASH_CR_PG;
+  for (int i = 0; (i < SECTOR_SIZE / 4) && !errors; i += 2) {
+    pageAddress[i] = data[i];
+    __ISB();
+    pageAddress[i + 1] = data[i + 1];
+    while (FLASH->SR & FLASH_SR_BSY) {
+      ;
+    }
+    errors = FLASH->SR & FLASH_PROGRAM_ERRORS;
+  }
+#else
+  FLASH->CR |= FLASH_PSIZE_WORD | FLASH_CR_PG;
+  for (int i = 0; (i < SECTOR_SIZE / 4) && !errors; i++) {
+    pageAddress[i] = data[i];
+    while (FLASH->SR & FLASH_SR_BSY) {
+      ;
+    }
+    errors = FLASH->SR & FLASH_PROGRAM_ERRORS;
   }
+#endif
+  CLEAR_BIT(FLASH->CR, FLASH_CR_PG);
+  __HAL_FLASH_CLEAR_FLAG(errors);
+
   HAL_GPIO_WritePin(LED_1_PORT, LED_1_PIN,GPIO_PIN_RESET);  
   HAL_FLASH_Lock();
+  return errors == 0;
 }
 /* USER CODE END 4 */
 
@@ -0,0 +1,439 @@
+/*******************************************************************************
+  *
+  * HID bootloader for STM32F407 MCU
+  *
+  ******************************************************************************
+  * @file           : protocol.c
+  * @brief          : Report queue, command parser and page assembly
+  ******************************************************************************
+  * Split from main.c: everything here runs in the main loop (but
+  * HID_ReportReceived(), called from the USB interrupt), and touches the
+  * hardware only through the hooks of protocol.h, so that it also builds
+  * for the host (see bootloader/host).
+  ******************************************************************************
+  */
+
+#include <string.h>
+#include "main.h"
+#include "protocol.h"
+#include "lz4.h"
+
+static const uint8_t CMD_SIGNATURE[7] = {'B','T','L','D','C','M','D'};
+
+/* Received reports, queued by the USB interrupt for the main loop. When
+   the queue is full the OUT endpoint is not re-armed, the host is NAKed
+   until the main loop frees a slot */
+#define RX_SLOTS 32
+static uint8_t rx_queue[RX_SLOTS][HID_RX_SIZE] __attribute__ ((aligned (4)));
+static volatile uint32_t rx_head = 0; /* Written by the USB interrupt */
+static volatile uint32_t rx_tail = 0; /* Written by the main loop */
+static volatile uint8_t rx_paused = 0;
+
+/* Page being received. A page sent as is may take one more report */
+static uint8_t pageData[SECTOR_SIZE + HID_RX_SIZE] __attribute__ ((aligned (4)));
+
+uint8_t reboot_requested = 0;
+
+/* Pages are LZ4 compressed, and decompressed into flashData */
+static uint8_t lz4_pages = 0;
+static uint8_t flashData[SECTOR_SIZE] __attribute__ ((aligned (4)));
+
+/* First page after the bootloader */
+#define USER_FIRST_PAGE (USER_CODE_OFFSET / SECTOR_SIZE)
+
+static uint32_t current_Page = USER_FIRST_PAGE;
+static uint16_t currentPageOffset = 0;
+
+/* Sectors erased since <reset pages>, one bit per sector. A sector is
+   erased ahead (<erase> command or image size given at <reset pages>),
+   or else when the first page inside it is written: the host may skip
+   the others. It is never erased twice. The pages of the sectors from
+   MAX_SECTORS on are rejected. */
+#define MAX_SECTORS 32
+static uint32_t erased_sectors = 0;
+
+/* Sectors still to be erased ahead: erase_next to erase_end - 1 */
+static uint32_t erase_next = 0;
+static uint32_t erase_end = 0;
+
+/* Pages written since <reset pages>, and last count acknowledged */
+static uint32_t pages_written = 0;
+static uint32_t pages_acknowledged = 0;
+
+/* Page after the last one written since <reset pages> (counted from
+   USER_FIRST_PAGE), 0 if none: where an interrupted upload resumes */
+static uint32_t written_page = 0;
+
+/* Command reply not sent yet, the previous one was still pending */
+static uint8_t reply_pending = 0;
+static uint8_t reply_code;
+static uint32_t reply_arg0, reply_arg1;
+
+static void process_report(uint8_t *report);
+static void queue_reply(uint8_t code, uint32_t arg0, uint32_t arg1);
+static void write_page(void);
+static void reset_pages(uint32_t image_size);
+static void schedule_erase(uint32_t first, uint32_t count);
+static void erase_ahead(void);
+static uint32_t sector_erase_time(uint32_t sector);
+static uint32_t received_page_size(const uint8_t *data);
+static const uint32_t *unpack_page(uint8_t *data);
+static uint32_t flash_sector(uint32_t page, uint32_t *first, uint32_t *count);
+static void send_pages_crc(uint32_t first, uint32_t count);
+static void send_image_crc(uint32_t size);
+
+/* One pass of the main loop */
+void protocol_task(void)
+{
+
+  /* Send the reply kept back before anything else, so that the next
+     ones do not overtake it */
+  if (reply_pending) {
+    if (!send_reply(reply_code, reply_arg0, reply_arg1)) {
+      return;
+    }
+    reply_pending = 0;
+  }
+
+  /* Erase the scheduled sectors before taking the next reports, they
+     wait in the queue meanwhile */
+  if (erase_next < erase_end) {
+    erase_ahead();
+    return;
+  }
+
+  /* Process the next queued report, and resume the reception if the
+     queue was full */
+  if (rx_tail != rx_head) {
+    process_report(rx_queue[rx_tail % RX_SLOTS]);
+    rx_tail++;
+    if (rx_paused) {
+      rx_paused = 0;
+      resume_reception();
+    }
+  }
+
+  /* Acknowledge the written pages. The count is cumulative, so a
+     reply that could not be sent yet is merged into the next one */
+  if ((pages_acknowledged != pages_written) &&
+      send_reply(CMD_PAGE_WRITTEN, pages_written, 0)) {
+    pages_acknowledged = pages_written;
+  }
+}
+
+/* Called from the USB interrupt with every received OUT report. Returns 0
+   once the queue is full, the endpoint is then re-armed by the main loop */
+uint8_t HID_ReportReceived(uint8_t *report)
+{
+  if ((rx_head - rx_tail) < RX_SLOTS) {
+    memcpy(rx_queue[rx_head % RX_SLOTS], report, HID_RX_SIZE);
+    rx_head++;
+  }
+  if ((rx_head - rx_tail) < RX_SLOTS) {
+    return 1;
+  }
+  rx_paused = 1;
+  return 0;
+}
+
+/* Send a command reply, or keep it for protocol_task() while the previous
+   one (a page acknowledge) is still pending. A newer erase status replaces
+   the one kept. */
+static void queue_reply(uint8_t code, uint32_t arg0, uint32_t arg1)
+{
+  if (!send_reply(code, arg0, arg1)) {
+    reply_code = code;
+    reply_arg0 = arg0;
+    reply_arg1 = arg1;
+    reply_pending = 1;
+  }
+}
+
+/* Command or page data report, processed in the main loop */
+static void process_report(uint8_t *report)
+{
+  uint32_t arg0, arg1;
+
+  if (memcmp(report, CMD_SIGNATURE, sizeof (CMD_SIGNATURE)) == 0) {
+    memcpy(&arg0, report + 8, sizeof (arg0));
+    memcpy(&arg1, report + 12, sizeof (arg1));
+    switch(report[7]){
+      case CMD_RESET_PAGES:
+
+      /*------------ Reset pages */
+      reset_pages(arg1);
+      lz4_pages = arg0 & RESET_LZ4;
+      break;
+
+      case CMD_REBOOT_MCU:
+
+      /*------------- Reset MCU, once the last page is written */
+      if (currentPageOffset > 0) {
+
+        /* There are incoming data that are less than page size */
+        write_page();
+      }
+      reboot_requested = 1;
+      break;
+
+      case CMD_GET_INFO:
+
+      /*------------- Protocol version, page window, Flash page size,
+                      capabilities and endpoint polling interval */
+      queue_reply(CMD_GET_INFO, PROTOCOL_VERSION | (PAGE_WINDOW << 8) |
+                  (SECTOR_SIZE << 16),
+                  CAP_PAGE_CRC | CAP_VERIFY | CAP_LZ4 | CAP_ERASE_AHEAD |
+                  CAP_ERASE | CAP_PROGRESS | (out_poll_interval << 16));
+      break;
+
+      case CMD_GET_CRC:
+
+      /*------------- CRC of <arg1> pages from page <arg0> */
+      send_pages_crc(arg0, arg1);
+      break;
+
+      case CMD_VERIFY:
+
+      /*------------- CRC of the <arg0> bytes long image */
+      send_image_crc(arg0);
+      break;
+
+      case CMD_ERASE:
+
+      /*------------- Erase the sectors of <arg1> pages from page <arg0>,
+                      up to the end of the flash memory if <arg1> is 0 */
+      schedule_erase(arg0, arg1);
+      break;
+
+      case CMD_GET_PROGRESS:
+
+      /*------------- Pages written since <reset pages>, and the page after
+                      the last one, to resume after a USB link drop */
+      queue_reply(CMD_GET_PROGRESS, pages_written, written_page);
+      break;
+
+      case CMD_SET_PAGE:
+
+      /*------------- Write the next page at page <arg0>, to skip
+                      unchanged pages. A page outside of the flash
+                      memory is ignored */
+      if (arg0 < *(uint16_t *) FLASHSIZE_BASE - USER_FIRST_PAGE) {
+        current_Page = USER_FIRST_PAGE + arg0;
+      }
+      currentPageOffset = 0;
+      break;
+    }
+    return;
+  }
+
+  memcpy(pageData + currentPageOffset, report, HID_RX_SIZE);
+  currentPageOffset += HID_RX_SIZE;
+  if (currentPageOffset >= received_page_size(pageData)) {
+    write_page();
+  }
+}
+
+/* Program the received page, erasing its sector (16, 32, 48, 64, 128 ...
+   kbytes) when writing the first page inside it, unless it was erased
+   ahead. The USB interrupt keeps queuing the next reports meanwhile. A
+   page past the end of the flash memory is dropped, and not counted. */
+static void write_page(void)
+{
+  uint32_t sector, first, count;
+
+  currentPageOffset = 0;
+  sector = flash_sector(current_Page, &first, &count);
+  if ((current_Page >= *(uint16_t *) FLASHSIZE_BASE) ||
+      (sector >= MAX_SECTORS)) {
+    current_Page++;
+    return;
+  }
+  if (!(erased_sectors & (1UL << sector))) {
+    erased_sectors |= 1UL << sector;
+    erase_sector(sector);
+  }
+  if (write_flash_sector(current_Page++, unpack_page(pageData))) {
+    pages_written++;
+    written_page = current_Page - USER_FIRST_PAGE;
+  }
+}
+
+/* Bytes sent for a page: a compressed page is preceded by its length and
+   padded to whole reports, a page sent as is has no length unless it is 0 */
+static uint32_t received_page_size(const uint8_t *data)
+{
+  uint32_t size;
+
+  size = data[0] | (data[1] << 8);
+  if (!lz4_pages || (size > LZ4_MAX_BLOCK)) {
+    return SECTOR_SIZE;
+  }
+  if (size == 0) {
+    size = SECTOR_SIZE;
+  }
+  size += LZ4_HEADER_SIZE;
+  return (size + HID_RX_SIZE - 1) & ~(HID_RX_SIZE - 1);
+}
+
+/* Page data to program, decompressed if needed. A page that does not
+   decompress to a whole page is left erased, verification reports it */
+static const uint32_t *unpack_page(uint8_t *data)
+{
+  uint32_t size;
+
+  size = data[0] | (data[1] << 8);
+  if (!lz4_pages || (size > LZ4_MAX_BLOCK)) {
+    return (uint32_t *) data;
+  }
+  if (size == 0) {
+    memcpy(flashData, data + LZ4_HEADER_SIZE, SECTOR_SIZE);
+  } else if (lz4_decompress(data + LZ4_HEADER_SIZE, size, flashData,
+                            SECTOR_SIZE) != SECTOR_SIZE) {
+    memset(flashData, 0xFF, SECTOR_SIZE);
+  }
+  return (uint32_t *) flashData;
+}
+
+/* Restart from the first page. A non zero <image_size> schedules the
+   erase of the sectors it covers, before any page is written */
+static void reset_pages(uint32_t image_size)
+{
+  current_Page = USER_FIRST_PAGE;
+  currentPageOffset = 0;
+  pages_written = pages_acknowledged = 0;
+  written_page = 0;
+  erased_sectors = 0;
+  erase_next = erase_end = 0;
+  if (image_size > 0) {
+    schedule_erase(0, (image_size + SECTOR_SIZE - 1) / SECTOR_SIZE);
+  }
+}
+
+/* Schedule the erase of the sectors holding <count> pages from <first>
+   (counted from the first page after the bootloader), up to the end of
+   the flash memory if <count> is 0. The main loop erases them one at a
+   time, before processing the next reports. */
+static void schedule_erase(uint32_t first, uint32_t count)
+{
+  uint32_t flash_pages = *(uint16_t *) FLASHSIZE_BASE;
+  uint32_t last_page, start, sector_count;
+
+  first += USER_FIRST_PAGE;
+  last_page = count ? first + count - 1 : flash_pages - 1;
+  if (last_page >= flash_pages) {
+    last_page = flash_pages - 1;
+  }
+  if (first > last_page) {
+    first = last_page;
+  }
+  erase_next = flash_sector(first, &start, &sector_count);
+  erase_end = flash_sector(last_page, &start, &sector_count) + 1;
+  if (erase_end > MAX_SECTORS) {
+    erase_end = MAX_SECTORS;
+  }
+}
+
+/* Typical erase time of a sector in ms, with x32 parallelism */
+static uint32_t sector_erase_time(uint32_t sector)
+{
+  if (sector < 4) {
+    return 250;
+  }
+  if (sector == 4) {
+    return 550;
+  }
+  return 1000;
+}
+
+/* Erase the next scheduled sector, unless it is already erased. The host
+   is told the time and number of sectors left before, and once more with
+   0 ms when the last one is erased: it waits for that last status, which
+   is kept until the IN endpoint takes it, however long its polling
+   interval. */
+static void erase_ahead(void)
+{
+  uint32_t time_left = 0;
+  uint32_t sectors = 0;
+  uint32_t sector;
+
+  for (sector = erase_next; sector < erase_end; sector++) {
+    if (!(erased_sectors & (1UL << sector))) {
+      time_left += sector_erase_time(sector);
+      sectors++;
+    }
+  }
+
+  sector = erase_next++;
+  if (!(erased_sectors & (1UL << sector))) {
+    queue_reply(CMD_ERASING, time_left, sectors);
+    erased_sectors |= 1UL << sector;
+    erase_sector(sector);
+  }
+
+  if (erase_next == erase_end) {
+    queue_reply(CMD_ERASING, 0, 0);
+  }
+}
+
+
+/* Flash sector holding a page, with the first page and page count of
+   that sector: 16 kB sectors 0 to 3, 64 kB sector 4, then 128 kB
+   sectors */
+static uint32_t flash_sector(uint32_t page, uint32_t *first, uint32_t *count)
+{
+  if (page < 64) {
+    *first = page & ~15;
+    *count = 16;
+    return page / 16;
+  }
+  if (page < 128) {
+    *first = 64;
+    *count = 64;
+    return 4;
+  }
+  *first = page & ~127;
+  *count = 128;
+  return 4 + (page / 128);
+}
+
+
+/* Reply with the CRC32 of <count> pages from <first> (counted from the
+   first page after the bootloader), extended to whole flash sectors so
+   that the host knows which pages are erased together. Pages past the
+   end of the flash memory are left out. */
+static void send_pages_crc(uint32_t first, uint32_t count)
+{
+  uint32_t flash_pages = *(uint16_t *) FLASHSIZE_BASE;
+  uint32_t start, end, sector_count;
+
+  first += USER_FIRST_PAGE;
+  flash_sector(first, &start, &sector_count);
+  flash_sector(first + (count ? count - 1 : 0), &end, &sector_count);
+  end += sector_count;
+  if (end > flash_pages) {
+    end = flash_pages;
+  }
+  if (start > end) {
+    start = end;
+  }
+  queue_reply(CMD_GET_CRC,
+              flash_crc((uint32_t *) (FLASH_BASE + (start * SECTOR_SIZE)),
+                        (end - start) * (SECTOR_SIZE / 4)),
+              (start - USER_FIRST_PAGE) | ((end - start) << 16));
+}
+
+/* Reply with the CRC32 of the <size> first bytes after the bootloader,
+   rounded up to whole words */
+static void send_image_crc(uint32_t size)
+{
+  uint32_t max_size = (*(uint16_t *) FLASHSIZE_BASE - USER_FIRST_PAGE) *
+                      SECTOR_SIZE;
+
+  if (size > max_size) {
+    size = max_size;
+  }
+  queue_reply(CMD_VERIFY,
+              flash_crc((uint32_t *) (FLASH_BASE + USER_CODE_OFFSET),
+                        (size + 3) / 4),
+              size);
+}
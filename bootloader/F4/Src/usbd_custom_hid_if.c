@@ -51,6 +51,7 @@
 #include "usbd_custom_hid_if.h"
 
 /* USER CODE BEGIN INCLUDE */
+#include "main.h"
 
 /* USER CODE END INCLUDE */
 
@@ -60,8 +61,6 @@
 
 /* USER CODE BEGIN PV */
 /* Private variables ---------------------------------------------------------*/
-extern uint8_t USB_RX_Buffer[CUSTOM_HID_EPOUT_SIZE];
-extern uint8_t new_data_is_received;
 /* USER CODE END PV */
 
 /** @addtogroup STM32_USB_OTG_DEVICE_LIBRARY
@@ -130,7 +129,7 @@ __ALIGN_BEGIN static uint8_t CUSTOM_HID_ReportDesc_FS[USBD_CUSTOM_HID_REPORT_DES
 	0x91, 0x03,			 //  OUTPUT (Cnst, Var, Abs)												   // 14B
 
 	0x75, 0x08,      //  REPORT_SIZE (8)                        // 9 B
-	0x95, CUSTOM_HID_EPIN_SIZE,      //  REPORT_COUNT (8)
+	0x95, CUSTOM_HID_EPIN_SIZE,      //  REPORT_COUNT (16 or 64)
 	0x81, 0x03,			 //  INPUT (Cnst, Var, Abs)												   // 14B
 	
 	/* USER CODE END 0 */
@@ -219,13 +218,9 @@ static int8_t CUSTOM_HID_OutEvent_FS(uint8_t event_idx, uint8_t state)
 	/* USER CODE BEGIN 6 */
   	USBD_CUSTOM_HID_HandleTypeDef *hhid = (USBD_CUSTOM_HID_HandleTypeDef*) hUsbDeviceFS.pClassData;
 
-	for (uint8_t i = 0; i <CUSTOM_HID_EPOUT_SIZE; i++) {
-
-		/* To read user data from PC */
-		USB_RX_Buffer[i] =  hhid->Report_buf[i];
-	}
-	new_data_is_received = 1;	
-	return USBD_OK;
+	/* To read user data from PC. USBD_BUSY leaves the endpoint NAKing
+	   until the main loop has room for more reports */
+	return HID_ReportReceived(hhid->Report_buf) ? USBD_OK : USBD_BUSY;
 
 	/* USER CODE END 6 */
 }
@@ -96,7 +96,6 @@
 #define USBD_MANUFACTURER_STRING			"www.serasidis.gr"
 #define USBD_PID_FS					48826  //BEBA hex
 #define USBD_PRODUCT_STRING_FS				"STM32 HID bootloader"
-#define USBD_SERIALNUMBER_STRING_FS			"1234567890"
 #define USBD_CONFIGURATION_STRING_FS			"STM32 HID bootloader Config"
 #define USBD_INTERFACE_STRING_FS			"STM32 HID bootloader Interface"
 
@@ -112,6 +111,24 @@
 
 /* USER CODE BEGIN 0 */
 
+/* Serial number: the 96-bit unique device ID, as 24 hex digits, so that
+ * the host can tell the boards apart
+ */
+static char USBD_SerialNumber[25];
+
+static void Get_SerialNum(void)
+{
+	const uint32_t *uid = (const uint32_t *) UID_BASE;
+	uint32_t i;
+	uint8_t nibble;
+
+	for (i = 0; i < 24; i++) {
+		nibble = (uid[i / 8] >> (28 - 4 * (i % 8))) & 0x0F;
+		USBD_SerialNumber[i] = nibble < 10 ? '0' + nibble : 'A' - 10 + nibble;
+	}
+	USBD_SerialNumber[24] = 0;
+}
+
 /* USER CODE END 0 */
 
 /** @defgroup USBD_DESC_Private_Macros USBD_DESC_Private_Macros
@@ -198,7 +215,7 @@ __ALIGN_BEGIN uint8_t USBD_FS_DeviceDesc[USB_LEN_DEV_DESC] __ALIGN_END =
 	HIBYTE(USBD_VID),           /*idVendor*/
 	LOBYTE(USBD_PID_FS),        /*idProduct*/
 	HIBYTE(USBD_PID_FS),        /*idProduct*/
-	0x00,                       /*bcdDevice rel. 3.00*/
+	0x10,                       /*bcdDevice rel. 3.10*/
 	0x03,
 	USBD_IDX_MFC_STR,           /*Index of manufacturer  string*/
 	USBD_IDX_PRODUCT_STR,       /*Index of product string*/
@@ -327,11 +344,8 @@ uint8_t * USBD_FS_ManufacturerStrDescriptor(USBD_SpeedTypeDef speed, uint16_t *l
   */
 uint8_t * USBD_FS_SerialStrDescriptor(USBD_SpeedTypeDef speed, uint16_t *length)
 {
-	if (speed == USBD_SPEED_HIGH) {
-		USBD_GetString((uint8_t *) USBD_SERIALNUMBER_STRING_FS, USBD_StrDesc, length);
-	} else {
-		USBD_GetString((uint8_t *) USBD_SERIALNUMBER_STRING_FS, USBD_StrDesc, length);
-	}
+	Get_SerialNum();
+	USBD_GetString((uint8_t *) USBD_SerialNumber, USBD_StrDesc, length);
 	return USBD_StrDesc;
 }
 
@@ -0,0 +1,242 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+// F1 protocol core on the host: HIDUSB_HandleData() gets the reports as
+// the USB interrupt would, and the pages are programmed between reports
+// as the main loop would (HIDUSB_FlashPages(), without the LED and the
+// endpoint handling). The f1-reset scenario sends <reset pages> from the
+// interrupt while a page is programmed, as the hid-flash resend path may.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usb.h"
+#include "hid.h"
+#include "flash.h"
+#include "protocol.h"
+#include "harness.h"
+
+#define FLASH_KB          64
+#define IMAGE_SIZE        (48 * 1024)
+#define RESET_BLANK_CHIP  0x01
+
+#define PROGRAM_NS        52500     // per half-word
+#define ERASE_NS          20000000  // per flash page
+
+static host_cost_t isr, main_loop;
+
+// Page to send <reset pages> at while it is programmed, -1 if none
+static int reset_page = -1;
+
+static void send_reset(void);
+
+// Stubs
+
+void USB_SendData(uint8_t EPn, uint16_t *Data, uint16_t Length) {
+  uint64_t start;
+
+  host_stub_begin(&start);
+  if ((EPn == ENDP1) && (Length == REPLY_SIZE)) {
+    host_record_reply((uint8_t *)Data);
+  }
+  host_stub_end(&start);
+}
+
+void FLASH_WritePage(uint16_t *page, uint16_t *data, uint16_t size, bool erase) {
+  uint32_t offset = (uint8_t *)page - host_flash;
+  uint8_t *flash_page = host_flash + (offset & ~(PAGE_SIZE - 1));
+  uint64_t start;
+  uint16_t i;
+
+  host_stub_begin(&start);
+
+  // The interrupt comes in the middle of the write
+  if ((reset_page >= 0) && (offset == (MIN_PAGE + reset_page) * HOST_PAGE_SIZE)) {
+    reset_page = -1;
+    send_reset();
+  }
+
+  // As the firmware, a blank page is not erased
+  if (erase) {
+    for (i = 0; (i < PAGE_SIZE) && (flash_page[i] == 0xFF); i++) {
+      ;
+    }
+    if (i < PAGE_SIZE) {
+      memset(flash_page, 0xFF, PAGE_SIZE);
+      host_work.erases++;
+      host_work.erase_ns += ERASE_NS;
+    }
+  }
+
+  // Programming can only clear bits
+  for (i = 0; i < size; i++) {
+    page[i] &= data[i];
+  }
+  host_work.programmed += size * 2;
+  host_work.program_ns += (uint64_t)size * PROGRAM_NS;
+  host_stub_end(&start);
+}
+
+uint32_t FLASH_CRC(uint32_t *address, uint32_t words) {
+  uint64_t start;
+  uint32_t crc;
+
+  host_stub_begin(&start);
+  crc = host_crc((uint8_t *)address, words);
+  host_work.crc_words += words;
+  host_stub_end(&start);
+  return crc;
+}
+
+// Driver
+
+static int receive_paused;
+
+// EP1 is always free on the host
+static void send_pending_reply(void) {
+  uint16_t *reply = HIDUSB_TakeReply();
+
+  if (reply) {
+    USB_SendData(ENDP1, reply, REPLY_SIZE);
+  }
+}
+
+static int handle_report(const uint8_t *report) {
+  uint8_t buffer[REPORT_SIZE];
+  uint64_t start;
+
+  // As the endpoint NAKs, no report comes in while the reception is paused
+  if (receive_paused) {
+    fprintf(stderr, "report received while the reception is paused\n");
+    return 0;
+  }
+  memcpy(buffer, report, REPORT_SIZE);
+  host_begin(&start);
+  receive_paused = !HIDUSB_HandleData(buffer, REPORT_SIZE);
+  send_pending_reply();
+  host_end(&isr, &start);
+  return 1;
+}
+
+static void send_reset(void) {
+  uint8_t report[REPORT_SIZE];
+
+  host_make_command(report, CMD_RESET_PAGES, 0, 0);
+  handle_report(report);
+}
+
+static void send_report(const uint8_t *report) {
+  uint64_t start;
+
+  handle_report(report);
+  host_begin(&start);
+  while (HIDUSB_NextPage()) {
+    HIDUSB_WritePage();
+  }
+  receive_paused = 0;
+  if (PagesAcknowledged != PagesWritten) {
+    PagesAcknowledged = PagesWritten;
+    HIDUSB_SendReply(CMD_PAGE_WRITTEN, PagesWritten, 0);
+    send_pending_reply();
+  }
+  host_end(&main_loop, &start);
+}
+
+static void send_command(uint8_t code, uint32_t arg0, uint32_t arg1) {
+  uint8_t report[REPORT_SIZE];
+
+  host_make_command(report, code, arg0, arg1);
+  send_report(report);
+}
+
+// With <reset>, <reset pages> is sent while page <reset> is programmed, and
+// the image is sent again
+static int upload(const char *scenario, const uint8_t *image, int blank, int reset) {
+  uint32_t offset;
+
+  host_reset(blank ? 0xFF : 0x00);
+  host_flash_kb = FLASH_KB;
+  memset(&isr, 0, sizeof(isr));
+  memset(&main_loop, 0, sizeof(main_loop));
+  UploadStarted = UploadFinished = false;
+  reset_page = reset;
+
+  // As hid-flash after <reset pages>, the first pass stops there. A
+  // <set page> that wraps below MIN_PAGE is ignored.
+  send_command(CMD_RESET_PAGES, blank ? RESET_BLANK_CHIP : 0, 0);
+  send_command(CMD_SET_PAGE, 0x10000 - MIN_PAGE, 0);
+  for (offset = 0; (offset < IMAGE_SIZE) && (reset_page == reset); offset += REPORT_SIZE) {
+    send_report(image + offset);
+  }
+  if (reset >= 0) {
+    if (reset_page >= 0) {
+      fprintf(stderr, "%s: page %d not programmed\n", scenario, reset);
+      return 0;
+    }
+    for (offset = 0; offset < IMAGE_SIZE; offset += REPORT_SIZE) {
+      send_report(image + offset);
+    }
+  }
+
+  // The pages written before <reset pages> are not counted
+  if (host_reply.pages_acked != IMAGE_SIZE / HOST_PAGE_SIZE) {
+    fprintf(stderr, "%s: %u pages acknowledged\n", scenario, host_reply.pages_acked);
+    return 0;
+  }
+  send_command(CMD_VERIFY, IMAGE_SIZE, 0);
+  send_command(CMD_REBOOT_MCU, 0, 0);
+  if (!UploadStarted || !UploadFinished) {
+    fprintf(stderr, "%s: upload not started or finished\n", scenario);
+    return 0;
+  }
+  return host_check(scenario, image, MIN_PAGE * HOST_PAGE_SIZE, IMAGE_SIZE);
+}
+
+static int run(const char *scenario, const uint8_t *image, int blank, int reset, int runs) {
+  host_cost_t best_isr = {0}, best_main = {0};
+  host_work_t work = {0};
+  int i;
+
+  for (i = 0; i < runs; i++) {
+    if (!upload(scenario, image, blank, reset)) {
+      return 0;
+    }
+    if ((i == 0) || (isr.total_ns + main_loop.total_ns < best_isr.total_ns + best_main.total_ns)) {
+      best_isr = isr;
+      best_main = main_loop;
+      work = host_work;
+    }
+  }
+  host_print(scenario, &best_isr, &best_main, &work);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  static uint8_t image[IMAGE_SIZE];
+  int runs = host_runs(argc, argv);
+  int ok = 1;
+
+  printf("F1 protocol core, %d byte flash pages, %d kB image\n", PAGE_SIZE, IMAGE_SIZE / 1024);
+  host_print_header();
+  host_make_image(image, IMAGE_SIZE, 0);
+  ok &= run("f1-erase", image, 0, -1, runs);
+  ok &= run("f1-blank", image, 1, -1, runs);
+  ok &= run("f1-reset", image, 0, IMAGE_SIZE / HOST_PAGE_SIZE / 2, runs);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,278 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+// F4 protocol core on the host: HID_ReportReceived() gets the reports as
+// the USB interrupt would, and protocol_task() runs once between reports
+// as the main loop would, or until the reception resumes when the report
+// queue is full.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "main.h"
+#include "protocol.h"
+#include "harness.h"
+#include "../../cli/lz4.h"
+
+#define FLASH_KB          512
+#define IMAGE_SIZE        (240 * 1024)
+#define MAX_TASKS         100000
+
+#define PROGRAM_NS        16000     // per word (x32 parallelism)
+
+static host_cost_t isr, main_loop;
+static int receiving;
+static int erase_done;
+
+// With in_busy, a reply keeps the IN endpoint busy for the next
+// IN_BUSY_TASKS passes of the main loop
+#define IN_BUSY_TASKS     2
+static int in_busy, in_pending;
+
+// Stubs
+
+const uint8_t out_poll_interval = 1;
+
+uint8_t send_reply(uint8_t code, uint32_t arg0, uint32_t arg1) {
+  uint8_t reply[REPORT_SIZE];
+  uint64_t start;
+
+  if (in_pending) {
+    return 0;
+  }
+  if (in_busy) {
+    in_pending = IN_BUSY_TASKS;
+  }
+  host_stub_begin(&start);
+  if ((code == CMD_ERASING) && (arg0 == 0)) {
+    erase_done = 1;
+  }
+  host_make_command(reply, code, arg0, arg1);
+  host_record_reply(reply);
+  host_stub_end(&start);
+  return 1;
+}
+
+uint8_t write_flash_sector(uint32_t page, const uint32_t *data) {
+  uint32_t *flash = (uint32_t *)(host_flash + page * SECTOR_SIZE);
+  uint64_t start;
+  int i;
+
+  host_stub_begin(&start);
+
+  // Programming can only clear bits
+  for (i = 0; i < SECTOR_SIZE / 4; i++) {
+    flash[i] &= data[i];
+  }
+  host_work.programmed += SECTOR_SIZE;
+  host_work.program_ns += (SECTOR_SIZE / 4) * PROGRAM_NS;
+  host_stub_end(&start);
+  return 1;
+}
+
+// 16 kB sectors 0 to 3, 64 kB sector 4, then 128 kB sectors, with their
+// typical erase time
+void erase_sector(uint32_t sector) {
+  uint32_t offset, size, ms;
+  uint64_t start;
+
+  host_stub_begin(&start);
+  if (sector < 4) {
+    offset = sector * 16384;
+    size = 16384;
+    ms = 250;
+  } else if (sector == 4) {
+    offset = 65536;
+    size = 65536;
+    ms = 550;
+  } else {
+    offset = (sector - 4) * 131072;
+    size = 131072;
+    ms = 1000;
+  }
+  memset(host_flash + offset, 0xFF, size);
+  host_work.erases++;
+  host_work.erase_ns += ms * 1000000ull;
+  host_stub_end(&start);
+}
+
+uint32_t flash_crc(const uint32_t *address, uint32_t words) {
+  uint64_t start;
+  uint32_t crc;
+
+  host_stub_begin(&start);
+  crc = host_crc((const uint8_t *)address, words);
+  host_work.crc_words += words;
+  host_stub_end(&start);
+  return crc;
+}
+
+void resume_reception(void) {
+  receiving = 1;
+}
+
+// Driver
+
+static void task(void) {
+  uint64_t start;
+
+  if (in_pending) {
+    in_pending--;
+  }
+  host_begin(&start);
+  protocol_task();
+  host_end(&main_loop, &start);
+}
+
+static int send_report(const uint8_t *report) {
+  uint8_t buffer[REPORT_SIZE];
+  uint64_t start;
+  int i;
+
+  for (i = 0; !receiving && (i < MAX_TASKS); i++) {
+    task();
+  }
+  if (!receiving) {
+    return 0;
+  }
+  memcpy(buffer, report, REPORT_SIZE);
+  host_begin(&start);
+  receiving = HID_ReportReceived(buffer);
+  host_end(&isr, &start);
+  task();
+  return 1;
+}
+
+static int send_command(uint8_t code, uint32_t arg0, uint32_t arg1) {
+  uint8_t report[REPORT_SIZE];
+
+  host_make_command(report, code, arg0, arg1);
+  return send_report(report);
+}
+
+// Reports of a page: as is, or LZ4 compressed as hid-flash sends it
+static uint32_t pack_page(const uint8_t *page, uint8_t *packet, int lz4) {
+  int size;
+
+  if (!lz4) {
+    memcpy(packet, page, SECTOR_SIZE);
+    return SECTOR_SIZE;
+  }
+  memset(packet, 0, SECTOR_SIZE + REPORT_SIZE);
+  size = lz4_compress(page, SECTOR_SIZE, packet + LZ4_HEADER_SIZE,
+                      SECTOR_SIZE - REPORT_SIZE - LZ4_HEADER_SIZE);
+  if (size > 0) {
+    packet[0] = size;
+    packet[1] = size >> 8;
+    size += LZ4_HEADER_SIZE;
+  } else if ((page[0] | (page[1] << 8)) > LZ4_MAX_BLOCK) {
+    memcpy(packet, page, SECTOR_SIZE);
+    size = SECTOR_SIZE;
+  } else {
+    memcpy(packet + LZ4_HEADER_SIZE, page, SECTOR_SIZE);
+    size = SECTOR_SIZE + LZ4_HEADER_SIZE;
+  }
+  return (size + REPORT_SIZE - 1) / REPORT_SIZE * REPORT_SIZE;
+}
+
+static int upload(const char *scenario, const uint8_t *image, int lz4, int busy) {
+  static uint8_t packet[SECTOR_SIZE + REPORT_SIZE];
+  uint32_t page, offset, size;
+  int i;
+
+  host_reset(0x00);
+  host_flash_kb = FLASH_KB;
+  memset(&isr, 0, sizeof(isr));
+  memset(&main_loop, 0, sizeof(main_loop));
+  receiving = 1;
+  reboot_requested = 0;
+  in_busy = busy;
+  in_pending = 0;
+  erase_done = 0;
+
+  // A <set page> that wraps into the bootloader is ignored
+  if (!send_command(CMD_RESET_PAGES, lz4 ? RESET_LZ4 : 0, IMAGE_SIZE) ||
+      !send_command(CMD_SET_PAGE, -(USER_CODE_OFFSET / SECTOR_SIZE), 0)) {
+    return 0;
+  }
+  for (page = 0; page < IMAGE_SIZE / SECTOR_SIZE; page++) {
+    size = pack_page(image + page * SECTOR_SIZE, packet, lz4);
+    for (offset = 0; offset < size; offset += REPORT_SIZE) {
+      if (!send_report(packet + offset)) {
+        fprintf(stderr, "%s: reception not resumed\n", scenario);
+        return 0;
+      }
+    }
+  }
+  if (!send_command(CMD_VERIFY, IMAGE_SIZE, 0) || !send_command(CMD_REBOOT_MCU, 0, 0)) {
+    return 0;
+  }
+  for (i = 0; !reboot_requested && (i < MAX_TASKS); i++) {
+    task();
+  }
+  if (!reboot_requested) {
+    fprintf(stderr, "%s: no reboot\n", scenario);
+    return 0;
+  }
+  if (!erase_done) {
+    fprintf(stderr, "%s: erase end not reported\n", scenario);
+    return 0;
+  }
+  return host_check(scenario, image, USER_CODE_OFFSET, IMAGE_SIZE);
+}
+
+static int run(const char *scenario, const uint8_t *image, int lz4, int busy, int runs) {
+  host_cost_t best_isr = {0}, best_main = {0};
+  host_work_t work = {0};
+  int i;
+
+  for (i = 0; i < runs; i++) {
+    if (!upload(scenario, image, lz4, busy)) {
+      return 0;
+    }
+    if ((i == 0) || (isr.total_ns + main_loop.total_ns < best_isr.total_ns + best_main.total_ns)) {
+      best_isr = isr;
+      best_main = main_loop;
+      work = host_work;
+    }
+  }
+  host_print(scenario, &best_isr, &best_main, &work);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  static uint8_t image[IMAGE_SIZE], sparse[IMAGE_SIZE], mixed[IMAGE_SIZE];
+  int runs = host_runs(argc, argv);
+  int ok = 1;
+
+  printf("F4 protocol core, %d kB image\n", IMAGE_SIZE / 1024);
+  host_print_header();
+  host_make_image(image, IMAGE_SIZE, 0);
+  host_make_image(sparse, IMAGE_SIZE, 1);
+  ok &= run("f4-raw", image, 0, 0, runs);
+  ok &= run("f4-lz4", sparse, 1, 0, runs);
+  // Pages that do not compress are sent as is, after a 0 length when their
+  // first bytes read as a block length
+  memcpy(mixed, image, IMAGE_SIZE);
+  memcpy(mixed, sparse, IMAGE_SIZE / 2);
+  mixed[IMAGE_SIZE - SECTOR_SIZE] = 0;
+  mixed[IMAGE_SIZE - SECTOR_SIZE + 1] = 0;
+  ok &= run("f4-lz4-raw", mixed, 1, 0, runs);
+  ok &= run("f4-busy", image, 0, 1, runs);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,207 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+// Shared part of the host harness: simulated flash memory, work counters,
+// timing and report
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "harness.h"
+
+#define RUNS              10
+
+uint8_t host_flash[HOST_FLASH_SIZE];
+uint16_t host_flash_kb;
+host_work_t host_work;
+host_reply_t host_reply;
+
+// Time taken by a host_ns() call, left out of each measure
+static uint64_t clock_ns;
+
+void *host_memcpy(void *dst, const void *src, size_t n) {
+  host_work.copied += n;
+  return memmove(dst, src, n);
+}
+
+void *host_memset(void *dst, int c, size_t n) {
+  host_work.set += n;
+  return memset(dst, c, n);
+}
+
+int host_memcmp(const void *a, const void *b, size_t n) {
+  host_work.compared += n;
+  return memcmp(a, b, n);
+}
+
+uint64_t host_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Time a call into the core, without the time spent in the stubs
+void host_begin(uint64_t *start) {
+  *start = host_ns() - host_work.stub_ns;
+}
+
+void host_end(host_cost_t *cost, const uint64_t *start) {
+  uint64_t ns = host_ns() - host_work.stub_ns - *start;
+
+  ns = ns > clock_ns ? ns - clock_ns : 0;
+  cost->calls++;
+  cost->total_ns += ns;
+  if (ns > cost->max_ns) {
+    cost->max_ns = ns;
+  }
+}
+
+void host_stub_begin(uint64_t *start) {
+  *start = host_ns();
+}
+
+void host_stub_end(const uint64_t *start) {
+  host_work.stub_ns += host_ns() - *start;
+}
+
+// Clear the counters, and fill the flash memory with <erased> (0xFF: the
+// flash is blank)
+void host_reset(uint8_t erased) {
+  uint64_t t, min = UINT64_MAX;
+  int i;
+
+  memset(&host_work, 0, sizeof(host_work));
+  memset(&host_reply, 0, sizeof(host_reply));
+  memset(host_flash, erased, sizeof(host_flash));
+  if (clock_ns == 0) {
+    for (i = 0; i < 1000; i++) {
+      t = host_ns();
+      t = host_ns() - t;
+      if (t < min) {
+        min = t;
+      }
+    }
+    clock_ns = min;
+  }
+}
+
+// Random image. A sparse image has the last 3/4 of each 1 kB page blank,
+// as the padding between sections of a firmware
+void host_make_image(uint8_t *image, uint32_t size, int sparse) {
+  uint32_t x = 2463534242u;
+  uint32_t i;
+
+  for (i = 0; i < size; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    image[i] = (sparse && (i % 1024) >= 256) ? 0xFF : (uint8_t)x;
+  }
+}
+
+void host_make_command(uint8_t *report, uint8_t code, uint32_t arg0, uint32_t arg1) {
+  static const uint8_t signature[] = {'B', 'T', 'L', 'D', 'C', 'M', 'D'};
+  int i;
+
+  memset(report, 0, REPORT_SIZE);
+  memcpy(report, signature, sizeof(signature));
+  report[7] = code;
+  for (i = 0; i < 4; i++) {
+    report[8 + i] = arg0 >> (8 * i);
+    report[12 + i] = arg1 >> (8 * i);
+  }
+}
+
+void host_record_reply(const uint8_t *reply) {
+  uint32_t arg0 = reply[8] | (reply[9] << 8) | (reply[10] << 16) | ((uint32_t)reply[11] << 24);
+
+  host_work.replies++;
+  if (reply[7] == PAGE_WRITTEN) {
+    host_reply.pages_acked = arg0;
+    return;
+  }
+  host_reply.code = reply[7];
+  host_reply.arg0 = arg0;
+  host_reply.arg1 = reply[12] | (reply[13] << 8) | (reply[14] << 16) | ((uint32_t)reply[15] << 24);
+}
+
+// CRC32 as computed by the STM32 CRC unit (Ethernet polynomial, 32-bit
+// little endian words, no reflection)
+uint32_t host_crc(const uint8_t *data, uint32_t words) {
+  uint32_t crc = 0xFFFFFFFF;
+  int bit;
+
+  while (words--) {
+    crc ^= data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+    for (bit = 0; bit < 32; bit++) {
+      crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+    }
+    data += 4;
+  }
+  return crc;
+}
+
+// Check that the image was programmed at <offset>, and verified
+int host_check(const char *scenario, const uint8_t *image, uint32_t offset, uint32_t size) {
+  if (memcmp(host_flash + offset, image, size) != 0) {
+    fprintf(stderr, "%s: the flash memory does not hold the image\n", scenario);
+    return 0;
+  }
+  if (host_reply.arg0 != host_crc(image, (size + 3) / 4)) {
+    fprintf(stderr, "%s: wrong CRC reply 0x%08X\n", scenario, host_reply.arg0);
+    return 0;
+  }
+  return 1;
+}
+
+void host_print_header(void) {
+  printf("%-10s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+         "", "reports", "isr", "isr", "main", "main", "copied", "program", "erase", "crc");
+  printf("%-10s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+         "scenario", "", "ns/rep", "max ns", "ns/rep", "max ns", "B/rep", "ms", "ms", "words");
+}
+
+void host_print(const char *scenario, const host_cost_t *isr, const host_cost_t *main_loop,
+                const host_work_t *work) {
+  uint64_t reports = isr->calls ? isr->calls : 1;
+
+  printf("%-10s %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu\n", scenario,
+         (unsigned long long)isr->calls,
+         (unsigned long long)(isr->total_ns / reports),
+         (unsigned long long)isr->max_ns,
+         (unsigned long long)(main_loop->total_ns / reports),
+         (unsigned long long)main_loop->max_ns,
+         (unsigned long long)(work->copied / reports),
+         (unsigned long long)(work->program_ns / 1000000),
+         (unsigned long long)(work->erase_ns / 1000000),
+         (unsigned long long)work->crc_words);
+}
+
+// Number of runs of each scenario (the fastest one is reported)
+int host_runs(int argc, char *argv[]) {
+  if ((argc == 3) && (strcmp(argv[1], "-n") == 0) && (atoi(argv[2]) > 0)) {
+    return atoi(argv[2]);
+  }
+  if (argc != 1) {
+    fprintf(stderr, "usage: %s [-n <runs>]\n", argv[0]);
+    exit(2);
+  }
+  return RUNS;
+}
@@ -0,0 +1,92 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+// Host build of the bootloader protocol cores (bootloader/F1/Src/protocol.c
+// and bootloader/F4/Src/protocol.c): the flash memory is a host buffer,
+// the flash and USB hooks are stubs that count the work done and the time
+// the flash would be busy (typical datasheet timings).
+
+#ifndef harness_INCLUDED
+#define harness_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HOST_FLASH_SIZE   (1024 * 1024)
+#define REPORT_SIZE       64
+#define PAGE_WRITTEN      0x02      // page acknowledge reply code
+
+extern uint8_t host_flash[HOST_FLASH_SIZE];
+extern uint16_t host_flash_kb;
+
+// Work done by the firmware core, and by the stubs on its behalf
+typedef struct {
+  uint64_t copied;        // bytes moved by memcpy()
+  uint64_t set;           // bytes set by memset()
+  uint64_t compared;      // bytes compared by memcmp()
+  uint64_t programmed;    // flash bytes programmed
+  uint64_t crc_words;     // flash words read for a CRC
+  uint32_t erases;        // flash pages or sectors erased
+  uint32_t replies;
+  uint64_t program_ns;    // simulated flash busy time
+  uint64_t erase_ns;
+  uint64_t stub_ns;       // host time spent in the stubs, left out
+} host_work_t;
+
+extern host_work_t host_work;
+
+// Host time spent in the core, per call
+typedef struct {
+  uint64_t calls;
+  uint64_t total_ns;
+  uint64_t max_ns;
+} host_cost_t;
+
+// Last reply sent by the core, and last page count acknowledged: as
+// hid-flash, the page acknowledges are kept apart from the command replies
+typedef struct {
+  uint8_t code;
+  uint32_t arg0;
+  uint32_t arg1;
+  uint32_t pages_acked;
+} host_reply_t;
+
+extern host_reply_t host_reply;
+
+void *host_memcpy(void *dst, const void *src, size_t n);
+void *host_memset(void *dst, int c, size_t n);
+int host_memcmp(const void *a, const void *b, size_t n);
+
+uint64_t host_ns(void);
+void host_begin(uint64_t *start);
+void host_end(host_cost_t *cost, const uint64_t *start);
+void host_stub_begin(uint64_t *start);
+void host_stub_end(const uint64_t *start);
+
+void host_reset(uint8_t erased);
+void host_make_image(uint8_t *image, uint32_t size, int sparse);
+void host_make_command(uint8_t *report, uint8_t code, uint32_t arg0, uint32_t arg1);
+void host_record_reply(const uint8_t *reply);
+uint32_t host_crc(const uint8_t *data, uint32_t words);
+int host_check(const char *scenario, const uint8_t *image, uint32_t offset, uint32_t size);
+void host_print_header(void);
+void host_print(const char *scenario, const host_cost_t *isr, const host_cost_t *main_loop,
+                const host_work_t *work);
+int host_runs(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,40 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+// Included ahead of the firmware sources built for the host: the flash
+// memory is host_flash, and the memory copies are counted
+
+#ifndef host_INCLUDED
+#define host_INCLUDED
+
+#include <string.h>
+#include "harness.h"
+
+// F1
+#define FLASH_BASE_ADDRESS  ((uintptr_t) host_flash)
+#define FLASH_SIZE_ADDRESS  ((uintptr_t) &host_flash_kb)
+
+// F4
+#define FLASH_BASE          ((uintptr_t) host_flash)
+#define FLASHSIZE_BASE      ((uintptr_t) &host_flash_kb)
+
+#define memcpy(dst, src, n) host_memcpy(dst, src, n)
+#define memset(dst, c, n)   host_memset(dst, c, n)
+#define memcmp(a, b, n)     host_memcmp(a, b, n)
+
+#endif
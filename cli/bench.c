@@ -0,0 +1,300 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+// Throughput benchmark: runs hid-flash-sim (or hid-flash on a real
+// device) on synthetic images, and prints the --json measures of every
+// upload as one JSON document:
+//
+//   {"backend":"sim","target":"f4","results":[
+//    {"pattern":"random","size":16384,"run":1,"exit":0,"wall_us":...,"wait_us":...,
+//     "upload":{"error":false,"bytes":...,"bytes_per_s":...,"ack_us":{"p50":...},...}},
+//    ...]}
+//
+// "upload" is null if hid-flash did not write its measures. "wall_us"
+// leaves out "wait_us": the time hid-flash waited for the device to
+// enumerate and, after the reboot, searched for the serial port (its
+// "enumerate" and "port_search" phases), about the same for every run.
+//
+// Options:
+//   --backend=sim|usb     hid-flash-sim (default) or hid-flash
+//   --target=f1|f4        simulated bootloader (default: f4)
+//   --port=<comport>      serial port given to hid-flash (usb backend)
+//   --sizes=<kB,...>      image sizes (default: 16,64,256,1024)
+//   --patterns=<list>     random, zero and/or sparse (0xFF filled, one
+//                         page in four random); default: all
+//   --runs=<n>            uploads of each image (default: 1)
+//   --args=<options>      more hid-flash options, e.g. "--compress"
+
+#define _GNU_SOURCE // setenv()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#define PAGE_SIZE         1024
+#define MAX_SIZES         16
+#define MAX_ARGS          16
+
+typedef struct {
+  const char *name;
+  uint32_t bootloader_kb;
+  uint32_t flash_kb;      // hid-sim.c default flash size
+} bench_target_t;
+
+static const bench_target_t targets[] = {
+  {"f1", 2, 64},
+  {"f4", 16, 512},
+};
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void make_image(uint8_t *image, uint32_t size, const char *pattern) {
+  uint32_t x = 2463534242u;
+  uint32_t i;
+
+  for(i = 0; i < size; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    if(strcmp(pattern, "zero") == 0) {
+      image[i] = 0;
+    }else if(strcmp(pattern, "sparse") == 0) {
+      image[i] = (i / PAGE_SIZE) % 4 == 3 ? (uint8_t)x : 0xFF;
+    }else{
+      image[i] = (uint8_t)x;
+    }
+  }
+}
+
+static int write_file(const char *path, const uint8_t *data, uint32_t size) {
+  FILE *file = fopen(path, "wb");
+  int ok;
+
+  if(!file) {
+    return 0;
+  }
+  ok = fwrite(data, 1, size, file) == size;
+  return (fclose(file) == 0) && ok;
+}
+
+// Read the JSON object hid-flash wrote, without its line end.
+// Returns 0 if there is none.
+static int read_json(const char *path, char *line, int size) {
+  FILE *file = fopen(path, "r");
+  int ok;
+
+  if(!file) {
+    return 0;
+  }
+  ok = fgets(line, size, file) != NULL;
+  fclose(file);
+  line[strcspn(line, "\n")] = 0;
+  return ok;
+}
+
+// Value of a "phases_us" member of the JSON object, 0 if not found
+static uint64_t phase_us(const char *json, const char *name) {
+  const char *phases = strstr(json, "\"phases_us\":{");
+  char key[32];
+  const char *value;
+
+  snprintf(key, sizeof(key), "\"%s\":", name);
+  value = phases ? strstr(phases, key) : NULL;
+  return value ? strtoull(value + strlen(key), NULL, 10) : 0;
+}
+
+// Run the backend with its output thrown away, and return its exit code
+static int run(char *const argv[]) {
+  pid_t pid;
+  int status, fd;
+
+  fflush(stdout);
+  pid = fork();
+  if(pid < 0) {
+    return -1;
+  }
+  if(pid == 0) {
+    fd = open("/dev/null", O_WRONLY);
+    if(fd >= 0) {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+    }
+    execv(argv[0], argv);
+    _exit(127);
+  }
+  if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+    return -1;
+  }
+  return WEXITSTATUS(status);
+}
+
+int main(int argc, char *argv[]) {
+  const bench_target_t *target = &targets[1];
+  const char *backend = "sim";
+  const char *port = NULL;
+  char *patterns = "random,zero,sparse";
+  char *sizes_arg = "16,64,256,1024";
+  char *extra_args = NULL;
+  uint32_t sizes[MAX_SIZES];
+  int n_sizes = 0;
+  int runs = 1;
+  char dir[1024], program[1100], image_path[] = "/tmp/hid-flash-bench-XXXXXX";
+  char json_path[sizeof(image_path) + 8], json_arg[sizeof(json_path) + 8];
+  char flash_kb[16];
+  char *child_argv[MAX_ARGS + 5];
+  int n_child_args;
+  char *pattern, *token, *saveptr;
+  char json[8192];
+  uint8_t *image = NULL;
+  uint64_t start, wall, wait;
+  int first = 1;
+  int fd, i, s, r, code;
+
+  for(i = 1; i < argc; i++) {
+    if(strncmp(argv[i], "--backend=", 10) == 0) {
+      backend = argv[i] + 10;
+    }else if(strncmp(argv[i], "--target=", 9) == 0) {
+      target = strcmp(argv[i] + 9, "f1") == 0 ? &targets[0] : &targets[1];
+    }else if(strncmp(argv[i], "--port=", 7) == 0) {
+      port = argv[i] + 7;
+    }else if(strncmp(argv[i], "--sizes=", 8) == 0) {
+      sizes_arg = argv[i] + 8;
+    }else if(strncmp(argv[i], "--patterns=", 11) == 0) {
+      patterns = argv[i] + 11;
+    }else if(strncmp(argv[i], "--runs=", 7) == 0) {
+      runs = atoi(argv[i] + 7);
+    }else if(strncmp(argv[i], "--args=", 7) == 0) {
+      extra_args = argv[i] + 7;
+    }else{
+      fprintf(stderr, "Usage: hid-flash-bench [--backend=sim|usb] [--target=f1|f4] [--port=<comport>] "
+                      "[--sizes=<kB,...>] [--patterns=random,zero,sparse] [--runs=<n>] [--args=<options>]\n");
+      return 1;
+    }
+  }
+  if(strcmp(backend, "usb") == 0 && !port) {
+    fprintf(stderr, "hid-flash-bench: the usb backend needs --port=<comport>\n");
+    return 1;
+  }
+  for(token = strtok_r(strdup(sizes_arg), ",", &saveptr); token && n_sizes < MAX_SIZES;
+      token = strtok_r(NULL, ",", &saveptr)) {
+    if(atoi(token) > 0) {
+      sizes[n_sizes++] = atoi(token) * 1024;
+    }
+  }
+  if(n_sizes == 0 || runs < 1) {
+    fprintf(stderr, "hid-flash-bench: nothing to run\n");
+    return 1;
+  }
+
+  // The backend sits next to this program
+  snprintf(dir, sizeof(dir), "%s", argv[0]);
+  if(strrchr(dir, '/')) {
+    *strrchr(dir, '/') = 0;
+  }else{
+    strcpy(dir, ".");
+  }
+  snprintf(program, sizeof(program), "%s/%s", dir, strcmp(backend, "usb") == 0 ? "hid-flash" : "hid-flash-sim");
+  if(access(program, X_OK) != 0) {
+    fprintf(stderr, "hid-flash-bench: %s not found, build it first\n", program);
+    return 1;
+  }
+
+  fd = mkstemp(image_path);
+  if(fd < 0) {
+    perror("hid-flash-bench");
+    return 1;
+  }
+  close(fd);
+  snprintf(json_path, sizeof(json_path), "%s.json", image_path);
+  snprintf(json_arg, sizeof(json_arg), "--json=%s", json_path);
+
+  if(strcmp(backend, "usb") == 0) {
+    printf("{\"backend\":\"usb\",\"target\":null,\"results\":[");
+  }else{
+    printf("{\"backend\":\"sim\",\"target\":\"%s\",\"results\":[", target->name);
+  }
+  setenv("HIDSIM_TARGET", target->name, 1);
+  for(pattern = strtok_r(strdup(patterns), ",", &saveptr); pattern;
+      pattern = strtok_r(NULL, ",", &saveptr)) {
+    for(s = 0; s < n_sizes; s++) {
+      image = realloc(image, sizes[s]);
+      if(!image) {
+        return 1;
+      }
+      make_image(image, sizes[s], pattern);
+      if(!write_file(image_path, image, sizes[s])) {
+        perror(image_path);
+        return 1;
+      }
+
+      // Give the simulated device room for the image
+      snprintf(flash_kb, sizeof(flash_kb), "%u", sizes[s] / 1024 + target->bootloader_kb);
+      if(sizes[s] / 1024 + target->bootloader_kb > target->flash_kb) {
+        setenv("HIDSIM_FLASH_KB", flash_kb, 1);
+      }else{
+        unsetenv("HIDSIM_FLASH_KB");
+      }
+
+      n_child_args = 0;
+      child_argv[n_child_args++] = program;
+      child_argv[n_child_args++] = json_arg;
+      if(extra_args) {
+        for(token = strtok(strdup(extra_args), " "); token && n_child_args < MAX_ARGS;
+            token = strtok(NULL, " ")) {
+          child_argv[n_child_args++] = token;
+        }
+      }
+      child_argv[n_child_args++] = image_path;
+      child_argv[n_child_args++] = (char *)(port ? port : "/dev/null");
+      child_argv[n_child_args] = NULL;
+
+      for(r = 1; r <= runs; r++) {
+        unlink(json_path);
+        start = now_us();
+        code = run(child_argv);
+        wall = now_us() - start;
+        wait = 0;
+        if(!read_json(json_path, json, sizeof(json))) {
+          strcpy(json, "null");
+        }else{
+          wait = phase_us(json, "enumerate") + phase_us(json, "port_search");
+          wait = wait < wall ? wait : wall;
+        }
+        printf("%s\n {\"pattern\":\"%s\",\"size\":%u,\"run\":%d,\"exit\":%d,\"wall_us\":%llu,\"wait_us\":%llu,"
+          "\"upload\":%s}", first ? "" : ",", pattern, sizes[s], r, code, (unsigned long long)(wall - wait),
+          (unsigned long long)wait, json);
+        first = 0;
+      }
+    }
+  }
+  printf("\n]}\n");
+  unlink(image_path);
+  unlink(json_path);
+  free(image);
+  return 0;
+}
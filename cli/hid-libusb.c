@@ -134,11 +134,32 @@ libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
-/* Linked List of input reports received from the device. */
+/* Ring of input reports received from the device. The slots are allocated
+   once in hid_open_path(), so that read_callback() does not allocate. When
+   the ring is full, the oldest report is dropped and counted. */
+#define INPUT_REPORT_SLOTS 32
+
+/* Interrupt IN transfers kept submitted at once, so that one is always
+   queued at the host controller while the callback of another runs. */
+#ifndef INPUT_TRANSFERS
+#define INPUT_TRANSFERS 4
+#endif
+
+/* Interrupt OUT transfers queued at once by hid_write_async(). */
+#ifndef OUTPUT_TRANSFERS
+#define OUTPUT_TRANSFERS 8
+#endif
+
+struct output_transfer {
+  struct libusb_transfer *transfer;
+  unsigned char *buffer;
+  size_t size; /* allocated */
+  int busy;    /* submitted, not completed yet */
+};
+
 struct input_report {
-  uint8_t *data;
+  uint8_t *data; /* input_ep_max_packet_size bytes */
   size_t len;
-  struct input_report *next;
 };
 
 
@@ -164,15 +185,27 @@ struct hid_device_ {
 
   /* Read thread objects */
   pthread_t thread;
-  pthread_mutex_t mutex; /* Protects input_reports */
+  pthread_mutex_t mutex; /* Protects the input report ring */
   pthread_cond_t condition;
   pthread_barrier_t barrier; /* Ensures correct startup sequence */
   int shutdown_thread;
-  int cancelled;
-  struct libusb_transfer *transfer;
-
-  /* List of received input reports. */
-  struct input_report *input_reports;
+  int cancelled; /* all the IN transfers are done */
+  struct libusb_transfer *transfers[INPUT_TRANSFERS];
+  int transfers_active; /* IN transfers submitted, read thread only */
+
+  /* Ring of received input reports. */
+  struct input_report input_reports[INPUT_REPORT_SLOTS];
+  uint8_t *input_report_data;
+  int input_head;     /* oldest report */
+  int input_count;    /* reports queued */
+  unsigned long input_overflows; /* reports dropped because the ring was full */
+
+  /* Output reports queued by hid_write_async(), protected by mutex.
+     They complete on the read thread, which handles the libusb events. */
+  struct output_transfer output_transfers[OUTPUT_TRANSFERS];
+  int writes_pending;
+  int write_error; /* a queued report failed, until hid_write_flush() */
+  pthread_cond_t write_condition;
 };
 
 static libusb_context *usb_context = NULL;
@@ -187,6 +220,7 @@ static hid_device *new_hid_device(void)
 
   pthread_mutex_init(&dev->mutex, NULL);
   pthread_cond_init(&dev->condition, NULL);
+  pthread_cond_init(&dev->write_condition, NULL);
   pthread_barrier_init(&dev->barrier, NULL, 2);
 
   return dev;
@@ -194,9 +228,19 @@ static hid_device *new_hid_device(void)
 
 static void free_hid_device(hid_device *dev)
 {
+  int i;
+
+  free(dev->input_report_data);
+  for (i = 0; i < OUTPUT_TRANSFERS; i++) {
+    if (dev->output_transfers[i].transfer)
+      libusb_free_transfer(dev->output_transfers[i].transfer);
+    free(dev->output_transfers[i].buffer);
+  }
+
   /* Clean up the thread objects */
   pthread_barrier_destroy(&dev->barrier);
   pthread_cond_destroy(&dev->condition);
+  pthread_cond_destroy(&dev->write_condition);
   pthread_mutex_destroy(&dev->mutex);
 
   /* Free the device itself */
@@ -735,49 +779,30 @@ static void read_callback(struct libusb_transfer *transfer)
   int res;
 
   if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
-
-    struct input_report *rpt = malloc(sizeof(*rpt));
-    rpt->data = malloc(transfer->actual_length);
-    memcpy(rpt->data, transfer->buffer, transfer->actual_length);
-    rpt->len = transfer->actual_length;
-    rpt->next = NULL;
+    struct input_report *rpt;
 
     pthread_mutex_lock(&dev->mutex);
 
-    /* Attach the new report object to the end of the list. */
-    if (dev->input_reports == NULL) {
-      /* The list is empty. Put it at the root. */
-      dev->input_reports = rpt;
-      pthread_cond_signal(&dev->condition);
+    /* Drop the oldest report if the user does not read them fast
+       enough, so that the ring never blocks the device. */
+    if (dev->input_count == INPUT_REPORT_SLOTS) {
+      return_data(dev, NULL, 0);
+      dev->input_overflows++;
     }
-    else {
-      /* Find the end of the list and attach. */
-      struct input_report *cur = dev->input_reports;
-      int num_queued = 0;
-      while (cur->next != NULL) {
-        cur = cur->next;
-        num_queued++;
-      }
-      cur->next = rpt;
 
-      /* Pop one off if we've reached 30 in the queue. This
-         way we don't grow forever if the user never reads
-         anything from the device. */
-      if (num_queued > 30) {
-        return_data(dev, NULL, 0);
-      }
-    }
+    /* Copy the report into the next free slot. */
+    rpt = &dev->input_reports[(dev->input_head + dev->input_count) % INPUT_REPORT_SLOTS];
+    rpt->len = transfer->actual_length;
+    memcpy(rpt->data, transfer->buffer, rpt->len);
+    dev->input_count++;
+    if (dev->input_count == 1)
+      pthread_cond_signal(&dev->condition);
+
     pthread_mutex_unlock(&dev->mutex);
   }
-  else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+  else if (transfer->status == LIBUSB_TRANSFER_CANCELLED ||
+           transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
     dev->shutdown_thread = 1;
-    dev->cancelled = 1;
-    return;
-  }
-  else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
-    dev->shutdown_thread = 1;
-    dev->cancelled = 1;
-    return;
   }
   else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
     //LOG("Timeout (normal)\n");
@@ -786,13 +811,19 @@ static void read_callback(struct libusb_transfer *transfer)
     LOG("Unknown transfer code: %d\n", transfer->status);
   }
 
-  /* Re-submit the transfer object. */
-  res = libusb_submit_transfer(transfer);
-  if (res != 0) {
+  /* Re-submit the transfer object, unless the read thread is
+     stopping. */
+  if (!dev->shutdown_thread) {
+    res = libusb_submit_transfer(transfer);
+    if (res == 0)
+      return;
     LOG("Unable to submit URB. libusb error code: %d\n", res);
     dev->shutdown_thread = 1;
-    dev->cancelled = 1;
   }
+
+  /* This transfer is done. The read thread stops once all of them are. */
+  if (--dev->transfers_active == 0)
+    dev->cancelled = 1;
 }
 
 
@@ -801,22 +832,36 @@ static void *read_thread(void *param)
   hid_device *dev = param;
   unsigned char *buf;
   const size_t length = dev->input_ep_max_packet_size;
-
-  /* Set up the transfer object. */
-  buf = malloc(length);
-  dev->transfer = libusb_alloc_transfer(0);
-  libusb_fill_interrupt_transfer(dev->transfer,
-    dev->device_handle,
-    dev->input_endpoint,
-    buf,
-    length,
-    read_callback,
-    dev,
-    5000/*timeout*/);
-
-  /* Make the first submission. Further submissions are made
-     from inside read_callback() */
-  libusb_submit_transfer(dev->transfer);
+  struct libusb_transfer *writes[OUTPUT_TRANSFERS];
+  int i, n_writes = 0;
+
+  /* Set up the transfer objects. They complete in the order they were
+     submitted, so the reports stay in order. */
+  for (i = 0; i < INPUT_TRANSFERS; i++) {
+    buf = malloc(length);
+    dev->transfers[i] = libusb_alloc_transfer(0);
+    if (!buf || !dev->transfers[i]) {
+      free(buf);
+      break;
+    }
+    libusb_fill_interrupt_transfer(dev->transfers[i],
+      dev->device_handle,
+      dev->input_endpoint,
+      buf,
+      length,
+      read_callback,
+      dev,
+      5000/*timeout*/);
+
+    /* Make the first submission. Further submissions are made
+       from inside read_callback() */
+    if (libusb_submit_transfer(dev->transfers[i]) == 0)
+      dev->transfers_active++;
+  }
+  if (dev->transfers_active == 0) {
+    dev->shutdown_thread = 1;
+    dev->cancelled = 1;
+  }
 
   /* Notify the main thread that the read thread is up and running. */
   pthread_barrier_wait(&dev->barrier);
@@ -839,23 +884,51 @@ static void *read_thread(void *param)
     }
   }
 
+  /* No more output reports can be queued from here. Note the output
+     transfers in use: a busy one may not be allocated or submitted yet
+     by hid_write_async(), which does that outside of the mutex. The
+     transfer objects are only freed in hid_close(). */
+  pthread_mutex_lock(&dev->mutex);
+  dev->shutdown_thread = 1;
+  for (i = 0; i < OUTPUT_TRANSFERS; i++) {
+    if (dev->output_transfers[i].busy && dev->output_transfers[i].transfer)
+      writes[n_writes++] = dev->output_transfers[i].transfer;
+  }
+  pthread_mutex_unlock(&dev->mutex);
+
   /* Cancel any transfer that may be pending. This call will fail
      if no transfers are pending, but that's OK. */
-  libusb_cancel_transfer(dev->transfer);
+  for (i = 0; i < INPUT_TRANSFERS; i++) {
+    if (dev->transfers[i])
+      libusb_cancel_transfer(dev->transfers[i]);
+  }
+  for (i = 0; i < n_writes; i++)
+    libusb_cancel_transfer(writes[i]);
 
   while (!dev->cancelled)
     libusb_handle_events_completed(usb_context, &dev->cancelled);
 
+  /* The output transfers only complete while events are handled. A
+     report submitted after the cancel above completes on its own, or
+     times out. */
+  pthread_mutex_lock(&dev->mutex);
+  while (dev->writes_pending) {
+    struct timeval tv = {0, 100000};
+    pthread_mutex_unlock(&dev->mutex);
+    libusb_handle_events_timeout(usb_context, &tv);
+    pthread_mutex_lock(&dev->mutex);
+  }
+
   /* Now that the read thread is stopping, Wake any threads which are
      waiting on data (in hid_read_timeout()). Do this under a mutex to
      make sure that a thread which is about to go to sleep waiting on
      the condition actually will go to sleep before the condition is
      signaled. */
-  pthread_mutex_lock(&dev->mutex);
   pthread_cond_broadcast(&dev->condition);
+  pthread_cond_broadcast(&dev->write_condition);
   pthread_mutex_unlock(&dev->mutex);
 
-  /* The dev->transfer->buffer and dev->transfer objects are cleaned up
+  /* The buffers and objects of dev->transfers are cleaned up
      in hid_close(). They are not cleaned up here because this thread
      could end either due to a disconnect or due to a user
      call to hid_close(). In both cases the objects can be safely
@@ -972,6 +1045,20 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
               }
             }
 
+            /* Allocate the input report ring. */
+            dev->input_report_data = malloc(INPUT_REPORT_SLOTS * dev->input_ep_max_packet_size);
+            if (!dev->input_report_data) {
+              LOG("can't allocate the input report ring\n");
+              free(dev_path);
+              libusb_release_interface(dev->device_handle, dev->interface);
+              libusb_close(dev->device_handle);
+              good_open = 0;
+              break;
+            }
+            for (i = 0; i < INPUT_REPORT_SLOTS; i++) {
+              dev->input_reports[i].data = dev->input_report_data + i * dev->input_ep_max_packet_size;
+            }
+
             pthread_create(&dev->thread, NULL, read_thread, dev);
 
             /* Wait here for the read thread to be initialized. */
@@ -1050,19 +1137,148 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
   }
 }
 
+static void write_callback(struct libusb_transfer *transfer)
+{
+  hid_device *dev = transfer->user_data;
+  int i;
+
+  pthread_mutex_lock(&dev->mutex);
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+      transfer->actual_length != transfer->length) {
+    LOG("Output report failed: %d\n", transfer->status);
+    dev->write_error = 1;
+  }
+  for (i = 0; i < OUTPUT_TRANSFERS; i++) {
+    if (dev->output_transfers[i].transfer == transfer)
+      dev->output_transfers[i].busy = 0;
+  }
+  dev->writes_pending--;
+  pthread_cond_broadcast(&dev->write_condition);
+  pthread_mutex_unlock(&dev->mutex);
+}
+
+int HID_API_EXPORT hid_write_async(hid_device *dev, const unsigned char *data, size_t length)
+{
+  struct output_transfer *out = NULL;
+  unsigned char *buffer;
+  int skipped_report_id = 0;
+  int i, res;
+
+  /* Reports sent on the Control Endpoint are not queued */
+  if (dev->output_endpoint <= 0)
+    return hid_write(dev, data, length);
+
+  if (data[0] == 0x0) {
+    data++;
+    length--;
+    skipped_report_id = 1;
+  }
+
+  /* Wait for a free transfer */
+  pthread_mutex_lock(&dev->mutex);
+  while (dev->writes_pending == OUTPUT_TRANSFERS && !dev->shutdown_thread && !dev->write_error)
+    pthread_cond_wait(&dev->write_condition, &dev->mutex);
+  if (dev->shutdown_thread || dev->write_error) {
+    pthread_mutex_unlock(&dev->mutex);
+    return -1;
+  }
+  for (i = 0; i < OUTPUT_TRANSFERS && !out; i++) {
+    if (!dev->output_transfers[i].busy)
+      out = &dev->output_transfers[i];
+  }
+  out->busy = 1;
+  dev->writes_pending++;
+  pthread_mutex_unlock(&dev->mutex);
+
+  /* Allocated on first use, then reused */
+  if (!out->transfer)
+    out->transfer = libusb_alloc_transfer(0);
+  if (out->size < length) {
+    buffer = realloc(out->buffer, length);
+    if (buffer) {
+      out->buffer = buffer;
+      out->size = length;
+    }
+  }
+  res = -1;
+  if (out->transfer && out->size >= length) {
+    memcpy(out->buffer, data, length);
+    libusb_fill_interrupt_transfer(out->transfer,
+      dev->device_handle,
+      dev->output_endpoint,
+      out->buffer,
+      length,
+      write_callback,
+      dev,
+      1000/*timeout millis*/);
+    res = libusb_submit_transfer(out->transfer);
+  }
+  if (res != 0) {
+    pthread_mutex_lock(&dev->mutex);
+    out->busy = 0;
+    dev->writes_pending--;
+    pthread_cond_broadcast(&dev->write_condition);
+    pthread_mutex_unlock(&dev->mutex);
+    return -1;
+  }
+
+  if (skipped_report_id)
+    length++;
+
+  return length;
+}
+
+int HID_API_EXPORT hid_write_flush(hid_device *dev, int milliseconds)
+{
+  struct timespec ts;
+  int res = 0;
+
+  pthread_mutex_lock(&dev->mutex);
+  if (milliseconds >= 0) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += milliseconds / 1000;
+    ts.tv_nsec += (milliseconds % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+  }
+  while (dev->writes_pending && !dev->shutdown_thread && res == 0) {
+    if (milliseconds >= 0)
+      res = pthread_cond_timedwait(&dev->write_condition, &dev->mutex, &ts);
+    else
+      res = pthread_cond_wait(&dev->write_condition, &dev->mutex);
+  }
+  res = (dev->writes_pending || dev->write_error) ? -1 : 0;
+  dev->write_error = 0;
+  pthread_mutex_unlock(&dev->mutex);
+
+  return res;
+}
+
+unsigned long HID_API_EXPORT hid_input_overflows(hid_device *dev)
+{
+  unsigned long overflows;
+
+  pthread_mutex_lock(&dev->mutex);
+  overflows = dev->input_overflows;
+  pthread_mutex_unlock(&dev->mutex);
+
+  return overflows;
+}
+
 /* Helper function, to simplify hid_read().
    This should be called with dev->mutex locked. */
 static int return_data(hid_device *dev, unsigned char *data, size_t length)
 {
-  /* Copy the data out of the linked list item (rpt) into the
-     return buffer (data), and delete the liked list item. */
-  struct input_report *rpt = dev->input_reports;
+  /* Copy the data out of the oldest slot (rpt) into the
+     return buffer (data), and free the slot. */
+  struct input_report *rpt = &dev->input_reports[dev->input_head];
   size_t len = (length < rpt->len)? length: rpt->len;
   if (len > 0)
     memcpy(data, rpt->data, len);
-  dev->input_reports = rpt->next;
-  free(rpt->data);
-  free(rpt);
+  dev->input_head = (dev->input_head + 1) % INPUT_REPORT_SLOTS;
+  dev->input_count--;
   return len;
 }
 
@@ -1088,7 +1304,7 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
   pthread_cleanup_push(&cleanup_mutex, dev);
 
   /* There's an input report queued up. Return it. */
-  if (dev->input_reports) {
+  if (dev->input_count) {
     /* Return the first one */
     bytes_read = return_data(dev, data, length);
     goto ret;
@@ -1103,10 +1319,10 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 
   if (milliseconds == -1) {
     /* Blocking */
-    while (!dev->input_reports && !dev->shutdown_thread) {
+    while (!dev->input_count && !dev->shutdown_thread) {
       pthread_cond_wait(&dev->condition, &dev->mutex);
     }
-    if (dev->input_reports) {
+    if (dev->input_count) {
       bytes_read = return_data(dev, data, length);
     }
   }
@@ -1122,10 +1338,10 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
       ts.tv_nsec -= 1000000000L;
     }
 
-    while (!dev->input_reports && !dev->shutdown_thread) {
+    while (!dev->input_count && !dev->shutdown_thread) {
       res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
       if (res == 0) {
-        if (dev->input_reports) {
+        if (dev->input_count) {
           bytes_read = return_data(dev, data, length);
           break;
         }
@@ -1234,19 +1450,30 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 
 void HID_API_EXPORT hid_close(hid_device *dev)
 {
+  int i;
+
   if (!dev)
     return;
 
   /* Cause read_thread() to stop. */
+  pthread_mutex_lock(&dev->mutex);
   dev->shutdown_thread = 1;
-  libusb_cancel_transfer(dev->transfer);
+  pthread_mutex_unlock(&dev->mutex);
+  for (i = 0; i < INPUT_TRANSFERS; i++) {
+    if (dev->transfers[i])
+      libusb_cancel_transfer(dev->transfers[i]);
+  }
 
   /* Wait for read_thread() to end. */
   pthread_join(dev->thread, NULL);
 
   /* Clean up the Transfer objects allocated in read_thread(). */
-  free(dev->transfer->buffer);
-  libusb_free_transfer(dev->transfer);
+  for (i = 0; i < INPUT_TRANSFERS; i++) {
+    if (dev->transfers[i]) {
+      free(dev->transfers[i]->buffer);
+      libusb_free_transfer(dev->transfers[i]);
+    }
+  }
 
   /* release the interface */
   libusb_release_interface(dev->device_handle, dev->interface);
@@ -1254,12 +1481,8 @@ void HID_API_EXPORT hid_close(hid_device *dev)
   /* Close the handle */
   libusb_close(dev->device_handle);
 
-  /* Clear out the queue of received reports. */
-  pthread_mutex_lock(&dev->mutex);
-  while (dev->input_reports) {
-    return_data(dev, NULL, 0);
-  }
-  pthread_mutex_unlock(&dev->mutex);
+  if (dev->input_overflows)
+    LOG("%lu input reports dropped\n", dev->input_overflows);
 
   free_hid_device(dev);
 }
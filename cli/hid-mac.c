@@ -113,9 +113,10 @@ struct hid_device_ {
   uint8_t *input_report_buf;
   CFIndex max_input_report_len;
   struct input_report *input_reports;
+  unsigned long input_overflows; /* reports dropped because the queue was full */
 
   pthread_t thread;
-  pthread_mutex_t mutex; /* Protects input_reports */
+  pthread_mutex_t mutex; /* Protects input_reports and input_overflows */
   pthread_cond_t condition;
   pthread_barrier_t barrier; /* Ensures correct startup sequence */
   pthread_barrier_t shutdown_barrier; /* Ensures correct shutdown sequence */
@@ -590,6 +591,7 @@ static void hid_report_callback(void *context, IOReturn result, void *sender,
        anything from the device. */
     if (num_queued > 30) {
       return_data(dev, NULL, 0);
+      dev->input_overflows++;
     }
   }
 
@@ -792,6 +794,29 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
   return set_report(dev, kIOHIDReportTypeOutput, data, length);
 }
 
+/* Reports are not queued on this platform: each one is sent before
+   returning, so there is nothing left to flush. */
+int HID_API_EXPORT hid_write_async(hid_device *dev, const unsigned char *data, size_t length)
+{
+  return hid_write(dev, data, length);
+}
+
+int HID_API_EXPORT hid_write_flush(hid_device *dev, int milliseconds)
+{
+  return 0;
+}
+
+unsigned long HID_API_EXPORT hid_input_overflows(hid_device *dev)
+{
+  unsigned long overflows;
+
+  pthread_mutex_lock(&dev->mutex);
+  overflows = dev->input_overflows;
+  pthread_mutex_unlock(&dev->mutex);
+
+  return overflows;
+}
+
 /* Helper function, so that this isn't duplicated in hid_read(). */
 static int return_data(hid_device *dev, unsigned char *data, size_t length)
 {
@@ -0,0 +1,917 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+// Virtual bootloader: the hidapi API on top of an in-process model of the
+// F1 and F4 bootloaders, to run hid-flash without a board. The model
+// follows the bootloader protocol, the page buffers and the flash erase
+// and program rules (programming can only clear bits), and the host waits
+// as long as the USB transfers and flash operations would take on the
+// real device (typical datasheet timings).
+//
+// Environment variables:
+//   HIDSIM_TARGET    f1 (default) or f4
+//   HIDSIM_FLASH_KB  flash size in kB (default: 64 on F1, 512 on F4).
+//                    F1 devices over 128 kB have 2 kB flash pages
+//   HIDSIM_FRAME_US  USB frame time in us (default: 1000)
+//   HIDSIM_FLASH     file holding the flash content, loaded when the
+//                    device is opened and saved when it is closed
+//   HIDSIM_DEVICES   number of devices enumerated (default: 1), each with
+//                    its own flash (HIDSIM_FLASH.<n> for device n)
+//   HIDSIM_DROP_ACK  drop the n-th page acknowledge, as if it were lost
+//   HIDSIM_DROP_LINK drop the USB link after the n-th OUT report. The
+//                    device keeps running, and is found again with its
+//                    bootloader state when it is next opened
+
+#define _GNU_SOURCE // wcsdup()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include <pthread.h>
+#include "hidapi.h"
+#include "lz4.h"
+
+#define SIM_VID           0x1209
+#define SIM_PID           0xBEBA
+#define SIM_RELEASE       0x0310
+
+#define HOST_PAGE_SIZE    1024
+#define REPORT_SIZE       64
+#define COMMAND_HEADER    16
+#define MAX_RX_SLOTS      32
+#define MAX_REPLIES       64
+#define MAX_UNPLUGGED     16
+
+#define WRITE_TIMEOUT     1000000 // us, as hid-libusb.c
+#define REPORT_US         5       // us to process a report on the device
+#define BLANK_CHECK_US    100     // us to check that an F1 flash page is erased
+#define F1_ERASE_US       20000   // us per F1 flash page
+#define LZ4_US            50      // us to decompress a page on the F4
+
+#define CMD_RESET_PAGES   0x00
+#define CMD_REBOOT_MCU    0x01
+#define CMD_PAGE_WRITTEN  0x02
+#define CMD_GET_INFO      0x03
+#define CMD_GET_CRC       0x04
+#define CMD_SET_PAGE      0x05
+#define CMD_VERIFY        0x06
+#define CMD_ERASING       0x07
+#define CMD_ERASE         0x08
+#define CMD_GET_PROGRESS  0x09
+
+#define CAP_PAGE_CRC      0x0001
+#define CAP_VERIFY        0x0002
+#define CAP_BLANK_CHIP    0x0004
+#define CAP_LZ4           0x0008
+#define CAP_ERASE_AHEAD   0x0010
+#define CAP_ERASE         0x0020
+#define CAP_PROGRESS      0x0040
+
+#define RESET_BLANK_CHIP  0x01
+#define RESET_LZ4         0x02
+
+#define LZ4_HEADER_SIZE   2
+#define LZ4_MAX_BLOCK     (HOST_PAGE_SIZE - LZ4_HEADER_SIZE - 1)
+
+typedef struct {
+  const char *name;
+  uint32_t bootloader_size;
+  uint32_t flash_kb;      // default flash size
+  int window;             // pages the host may send ahead of the ACKs
+  int reply_size;         // IN report size
+  int in_interval;        // IN endpoint polling interval, ms
+  int rx_slots;           // queued reports, 0 if handled in the USB interrupt
+  uint16_t capabilities;
+  uint32_t program_us;    // to program a 1 kB page
+  uint32_t crc_ns;        // per CRC word
+} sim_target_t;
+
+static const sim_target_t targets[] = {
+  {"f1", 2048, 64, 2, 16, 5, 0, CAP_PAGE_CRC | CAP_VERIFY | CAP_BLANK_CHIP | CAP_PROGRESS, 26880, 60},
+  {"f4", 16384, 512, 8, 64, 1, MAX_RX_SLOTS,
+   CAP_PAGE_CRC | CAP_VERIFY | CAP_LZ4 | CAP_ERASE_AHEAD | CAP_ERASE | CAP_PROGRESS, 4096, 25},
+};
+
+typedef struct {
+  uint8_t data[REPORT_SIZE];
+  uint64_t ready;         // when the host can read it
+} sim_reply_t;
+
+struct hid_device_ {
+  const sim_target_t *target;
+  uint8_t *flash;
+  uint32_t flash_pages;   // host pages
+  uint32_t erase_pages;   // host pages per F1 flash page
+  char *flash_file;
+  int index;              // device number, from the path
+  uint32_t frame_us;
+  int blocking;
+  int rebooted;
+  uint32_t drop_link;     // OUT reports before the link drops, 0: never
+  int link_down;
+
+  // USB
+  uint64_t out_free;      // first time the next OUT report can be sent
+  uint64_t slot_free[MAX_RX_SLOTS]; // when each receive queue slot frees
+  uint32_t reports;
+  sim_reply_t replies[MAX_REPLIES];
+  int reply_head;
+  int reply_tail;
+
+  // Bootloader
+  uint64_t busy;          // the main loop is busy until then
+  uint8_t page[HOST_PAGE_SIZE + REPORT_SIZE];
+  uint32_t page_offset;
+  uint32_t current_page;
+  uint32_t pages_written;
+  uint32_t written_page;  // page after the last one written
+  int lz4;
+  int blank;
+  uint32_t erased_page;   // F1: last flash page erased
+  uint32_t erased_sectors; // F4: one bit per erased sector
+  uint64_t buffer_free[2]; // F1: when each page buffer is programmed
+  int rx_buffer;
+
+  // Statistics
+  uint32_t pages_programmed;
+  uint32_t erases;
+  uint64_t erase_us;
+  uint64_t program_us;
+  uint32_t overruns;
+  uint32_t lost_replies;
+  uint32_t acks;
+  uint32_t drop_ack;
+};
+
+// Devices whose USB link dropped: they keep running, and are found again
+// with their bootloader state when they are opened again
+static hid_device *unplugged[MAX_UNPLUGGED];
+static pthread_mutex_t unplugged_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t sim_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sim_sleep_until(uint64_t t) {
+  uint64_t now = sim_now();
+  struct timespec ts;
+
+  if(t > now) {
+    ts.tv_sec = (t - now) / 1000000;
+    ts.tv_nsec = ((t - now) % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+  }
+}
+
+static uint32_t get_le32(const uint8_t *buffer) {
+  return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+static void put_le32(uint8_t *buffer, uint32_t value) {
+  buffer[0] = value;
+  buffer[1] = value >> 8;
+  buffer[2] = value >> 16;
+  buffer[3] = value >> 24;
+}
+
+// STM32 CRC unit: Ethernet polynomial, not reflected, 32-bit words
+static uint32_t sim_crc(const uint8_t *data, uint32_t words) {
+  uint32_t crc = 0xFFFFFFFF;
+
+  while(words--) {
+    crc ^= get_le32(data);
+    for(int i = 0; i < 32; i++) {
+      crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+    }
+    data += 4;
+  }
+  return crc;
+}
+
+static int is_f4(hid_device *dev) {
+  return dev->target->rx_slots > 0;
+}
+
+static uint32_t first_page(hid_device *dev) {
+  return dev->target->bootloader_size / HOST_PAGE_SIZE;
+}
+
+// Queue a reply, readable once the IN endpoint is next polled after <t>
+static void send_reply(hid_device *dev, uint64_t t, uint8_t code, uint32_t arg0, uint32_t arg1) {
+  uint64_t interval = dev->target->in_interval * dev->frame_us;
+  sim_reply_t *reply;
+
+  if(code == CMD_PAGE_WRITTEN && ++dev->acks == dev->drop_ack) {
+    dev->lost_replies++;
+    return;
+  }
+  if((dev->reply_tail + 1) % MAX_REPLIES == dev->reply_head) {
+    dev->lost_replies++;
+    return;
+  }
+  reply = &dev->replies[dev->reply_tail];
+  memset(reply->data, 0, REPORT_SIZE);
+  memcpy(reply->data, "BTLDCMD", 7);
+  reply->data[7] = code;
+  put_le32(reply->data + 8, arg0);
+  put_le32(reply->data + 12, arg1);
+  reply->ready = (t + interval - 1) / interval * interval;
+  dev->reply_tail = (dev->reply_tail + 1) % MAX_REPLIES;
+}
+
+// F4 sector holding a page: 16 kB sectors 0 to 3, 64 kB sector 4, then
+// 128 kB sectors
+static uint32_t flash_sector(uint32_t page, uint32_t *first, uint32_t *count) {
+  if(page < 64) {
+    *first = page & ~15;
+    *count = 16;
+    return page / 16;
+  }
+  if(page < 128) {
+    *first = 64;
+    *count = 64;
+    return 4;
+  }
+  *first = page & ~127;
+  *count = 128;
+  return 4 + page / 128;
+}
+
+static uint32_t sector_erase_us(uint32_t sector) {
+  return sector < 4 ? 250000 : sector == 4 ? 550000 : 1000000;
+}
+
+// Erase <count> host pages from <page>, returns the time it takes. The
+// last sector may end past a flash size that is not a whole number of
+// sectors.
+static uint64_t erase_pages(hid_device *dev, uint32_t page, uint32_t count, uint64_t us) {
+  if(page + count > dev->flash_pages) {
+    count = page < dev->flash_pages ? dev->flash_pages - page : 0;
+  }
+  memset(dev->flash + page * HOST_PAGE_SIZE, 0xFF, count * HOST_PAGE_SIZE);
+  dev->erases++;
+  dev->erase_us += us;
+  return us;
+}
+
+static uint64_t erase_sector(hid_device *dev, uint32_t sector) {
+  uint32_t page = 0;
+  uint32_t first, count;
+
+  while(flash_sector(page, &first, &count) != sector) {
+    page = first + count;
+  }
+  dev->erased_sectors |= 1 << sector;
+  return erase_pages(dev, first, count, sector_erase_us(sector));
+}
+
+// Erase the F4 sectors of <count> pages from <first> (0: to the end of
+// the flash) from time <t>, reporting the progress as the F4 does
+static uint64_t erase_ahead(hid_device *dev, uint32_t first, uint32_t count, uint64_t t) {
+  uint32_t last_page, next, end, start, n, sector, sectors;
+  uint64_t time_left;
+
+  first += first_page(dev);
+  last_page = count ? first + count - 1 : dev->flash_pages - 1;
+  if(last_page >= dev->flash_pages) {
+    last_page = dev->flash_pages - 1;
+  }
+  if(first > last_page) {
+    first = last_page;
+  }
+  next = flash_sector(first, &start, &n);
+  end = flash_sector(last_page, &start, &n) + 1;
+  for(; next < end; next++) {
+    if(dev->erased_sectors & (1 << next)) {
+      continue;
+    }
+    for(time_left = 0, sectors = 0, sector = next; sector < end; sector++) {
+      if(!(dev->erased_sectors & (1 << sector))) {
+        time_left += sector_erase_us(sector) / 1000;
+        sectors++;
+      }
+    }
+    send_reply(dev, t, CMD_ERASING, time_left, sectors);
+    t += erase_sector(dev, next);
+  }
+  send_reply(dev, t, CMD_ERASING, 0, 0);
+  return t;
+}
+
+// Program a received page, returns the time it takes
+static uint64_t program_page(hid_device *dev) {
+  uint8_t data[HOST_PAGE_SIZE];
+  uint8_t *flash = dev->flash + dev->current_page * HOST_PAGE_SIZE;
+  uint32_t unit, first, count, size;
+  uint64_t us = dev->target->program_us;
+
+  memcpy(data, dev->page, HOST_PAGE_SIZE);
+  size = dev->page[0] | (dev->page[1] << 8);
+  if(dev->lz4 && size <= LZ4_MAX_BLOCK) {
+    us += LZ4_US;
+    if(size == 0) {
+      memcpy(data, dev->page + LZ4_HEADER_SIZE, HOST_PAGE_SIZE);
+    }else if(lz4_decompress(dev->page + LZ4_HEADER_SIZE, size, data, HOST_PAGE_SIZE) != HOST_PAGE_SIZE) {
+      memset(data, 0xFF, HOST_PAGE_SIZE);
+    }
+  }
+
+  if(dev->current_page < dev->flash_pages) {
+    if(is_f4(dev)) {
+      unit = flash_sector(dev->current_page, &first, &count);
+      if(!(dev->erased_sectors & (1 << unit))) {
+        us += erase_sector(dev, unit);
+      }
+    }else{
+      unit = dev->current_page / dev->erase_pages;
+      if(!dev->blank && unit != dev->erased_page) {
+        first = unit * dev->erase_pages;
+        us += BLANK_CHECK_US;
+        for(uint32_t i = 0; i < dev->erase_pages * HOST_PAGE_SIZE; i++) {
+          if(dev->flash[first * HOST_PAGE_SIZE + i] != 0xFF) {
+            us += erase_pages(dev, first, dev->erase_pages, F1_ERASE_US);
+            break;
+          }
+        }
+      }
+      dev->erased_page = unit;
+    }
+
+    // Programming can only clear bits
+    for(int i = 0; i < HOST_PAGE_SIZE; i++) {
+      flash[i] &= data[i];
+    }
+  }
+  dev->current_page++;
+  dev->page_offset = 0;
+  dev->pages_written++;
+  dev->written_page = dev->current_page - first_page(dev);
+  dev->pages_programmed++;
+  dev->program_us += dev->target->program_us;
+  return us;
+}
+
+// Reply with the CRC of <count> pages from <first>, extended to whole
+// erase units, returns the time it takes
+static uint64_t send_pages_crc(hid_device *dev, uint64_t t, uint32_t first, uint32_t count) {
+  uint32_t start, end, n;
+
+  first += first_page(dev);
+  if(is_f4(dev)) {
+    flash_sector(first, &start, &n);
+    flash_sector(first + (count ? count - 1 : 0), &end, &n);
+    end += n;
+  }else{
+    first &= 0xFFFF;
+    count &= 0xFFFF;
+    start = first & ~(dev->erase_pages - 1);
+    end = (first + (count ? count : 1) + dev->erase_pages - 1) & ~(dev->erase_pages - 1);
+  }
+  if(end > dev->flash_pages) {
+    end = dev->flash_pages;
+  }
+  if(start > end) {
+    start = end;
+  }
+  n = (end - start) * (HOST_PAGE_SIZE / 4);
+  t += (uint64_t)n * dev->target->crc_ns / 1000;
+  send_reply(dev, t, CMD_GET_CRC, sim_crc(dev->flash + start * HOST_PAGE_SIZE, n),
+             (start - first_page(dev)) | ((end - start) << 16));
+  return t;
+}
+
+static uint64_t send_image_crc(hid_device *dev, uint64_t t, uint32_t size) {
+  uint32_t max_size = (dev->flash_pages - first_page(dev)) * HOST_PAGE_SIZE;
+
+  if(size > max_size) {
+    size = max_size;
+  }
+  t += (uint64_t)(size + 3) / 4 * dev->target->crc_ns / 1000;
+  send_reply(dev, t, CMD_VERIFY,
+             sim_crc(dev->flash + dev->target->bootloader_size, (size + 3) / 4), size);
+  return t;
+}
+
+static int is_command(hid_device *dev, const uint8_t *report) {
+  if(memcmp(report, "BTLDCMD", 7) != 0) {
+    return 0;
+  }
+
+  // The F1 only takes commands padded with zeros
+  for(int i = COMMAND_HEADER; !is_f4(dev) && i < REPORT_SIZE; i++) {
+    if(report[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Process a command at time <t>, returns when it is done
+static uint64_t process_command(hid_device *dev, const uint8_t *report, uint64_t t) {
+  const sim_target_t *target = dev->target;
+  uint32_t arg0 = get_le32(report + 8);
+  uint32_t arg1 = get_le32(report + 12);
+
+  switch(report[7]) {
+    case CMD_RESET_PAGES:
+      dev->current_page = first_page(dev);
+      dev->page_offset = 0;
+      dev->pages_written = 0;
+      dev->written_page = 0;
+      dev->erased_page = 0;
+      dev->erased_sectors = 0;
+      dev->blank = (target->capabilities & CAP_BLANK_CHIP) && (arg0 & RESET_BLANK_CHIP);
+      dev->lz4 = (target->capabilities & CAP_LZ4) && (arg0 & RESET_LZ4);
+      if((target->capabilities & CAP_ERASE_AHEAD) && arg1) {
+        t = erase_ahead(dev, 0, (arg1 + HOST_PAGE_SIZE - 1) / HOST_PAGE_SIZE, t);
+      }
+      break;
+
+    case CMD_REBOOT_MCU:
+      if(is_f4(dev) && dev->page_offset > 0) {
+        t += program_page(dev);
+      }
+      dev->page_offset = 0;
+      dev->rebooted = 1;
+      break;
+
+    case CMD_GET_INFO:
+      send_reply(dev, t, CMD_GET_INFO,
+                 1 | (target->window << 8) | ((dev->erase_pages * HOST_PAGE_SIZE) << 16),
+                 target->capabilities | (1 << 16));
+      break;
+
+    case CMD_GET_CRC:
+      t = send_pages_crc(dev, t, arg0, arg1);
+      break;
+
+    case CMD_GET_PROGRESS:
+      send_reply(dev, t, CMD_GET_PROGRESS, dev->pages_written, dev->written_page);
+      break;
+
+    case CMD_SET_PAGE:
+      dev->current_page = first_page(dev) + (is_f4(dev) ? arg0 : (arg0 & 0xFFFF));
+      dev->page_offset = 0;
+      break;
+
+    case CMD_VERIFY:
+      t = send_image_crc(dev, t, arg0);
+      break;
+
+    case CMD_ERASE:
+      if(target->capabilities & CAP_ERASE) {
+        t = erase_ahead(dev, arg0, arg1, t);
+      }
+      break;
+  }
+  return t;
+}
+
+// Bytes sent for a page: a compressed page is preceded by its length and
+// padded to whole reports, a page sent as is has no length unless it is 0
+static uint32_t received_page_size(hid_device *dev) {
+  uint32_t size;
+
+  size = dev->page[0] | (dev->page[1] << 8);
+  if(!dev->lz4 || size > LZ4_MAX_BLOCK) {
+    return HOST_PAGE_SIZE;
+  }
+  if(size == 0) {
+    size = HOST_PAGE_SIZE;
+  }
+  size += LZ4_HEADER_SIZE;
+  return (size + REPORT_SIZE - 1) & ~(REPORT_SIZE - 1);
+}
+
+// F1: the USB interrupt takes the report at <t> and hands the complete
+// pages over to the main loop, which programs them one after the other.
+// Returns when the interrupt is done.
+static uint64_t f1_report(hid_device *dev, const uint8_t *report, uint64_t t) {
+  if(dev->page_offset == 0 && is_command(dev, report)) {
+    return process_command(dev, report, t);
+  }
+
+  // The host must not send a page before its buffer is programmed
+  if(dev->page_offset == 0 && t < dev->buffer_free[dev->rx_buffer]) {
+    dev->overruns++;
+  }
+  memcpy(dev->page + dev->page_offset, report, REPORT_SIZE);
+  dev->page_offset += REPORT_SIZE;
+  if(dev->page_offset >= HOST_PAGE_SIZE) {
+    if(dev->busy < t) {
+      dev->busy = t;
+    }
+    dev->busy += program_page(dev);
+    dev->buffer_free[dev->rx_buffer] = dev->busy;
+    dev->rx_buffer ^= 1;
+    send_reply(dev, dev->busy, CMD_PAGE_WRITTEN, dev->pages_written, 0);
+  }
+  return t;
+}
+
+// F4: the report waits in the receive queue until the main loop takes it.
+// Returns when the main loop is done with it.
+static uint64_t f4_report(hid_device *dev, const uint8_t *report, uint64_t t) {
+  if(dev->busy < t) {
+    dev->busy = t;
+  }
+  dev->busy += REPORT_US;
+  if(is_command(dev, report)) {
+    dev->busy = process_command(dev, report, dev->busy);
+    return dev->busy;
+  }
+  memcpy(dev->page + dev->page_offset, report, REPORT_SIZE);
+  dev->page_offset += REPORT_SIZE;
+  if(dev->page_offset >= received_page_size(dev)) {
+    dev->busy += program_page(dev);
+    send_reply(dev, dev->busy, CMD_PAGE_WRITTEN, dev->pages_written, 0);
+  }
+  return dev->busy;
+}
+
+int HID_API_EXPORT hid_init(void) {
+  return 0;
+}
+
+int HID_API_EXPORT hid_exit(void) {
+  return 0;
+}
+
+static const sim_target_t *sim_target(void) {
+  const char *name = getenv("HIDSIM_TARGET");
+
+  for(size_t i = 0; name && i < sizeof(targets) / sizeof(targets[0]); i++) {
+    if(strcmp(name, targets[i].name) == 0) {
+      return &targets[i];
+    }
+  }
+  return &targets[0];
+}
+
+static int sim_devices(void) {
+  const char *env = getenv("HIDSIM_DEVICES");
+  int devices = env ? atoi(env) : 1;
+
+  return devices > 0 ? devices : 1;
+}
+
+// Serial number of device <n>, 24 hex digits like the chip unique ID
+static wchar_t *sim_serial(int n) {
+  wchar_t serial[25];
+
+  swprintf(serial, 25, L"%024X", 0x5100 + n);
+  return wcsdup(serial);
+}
+
+// Devices are "sim:<target>", or "sim:<target>:<n>" when there are several
+struct hid_device_info HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id) {
+  struct hid_device_info *devs = NULL;
+  struct hid_device_info **last = &devs;
+  struct hid_device_info *info;
+  char path[32];
+  int devices = sim_devices();
+
+  if((vendor_id && vendor_id != SIM_VID) || (product_id && product_id != SIM_PID)) {
+    return NULL;
+  }
+  for(int n = 0; n < devices; n++) {
+    info = calloc(1, sizeof(*info));
+    if(!info) {
+      break;
+    }
+    if(devices > 1) {
+      snprintf(path, sizeof(path), "sim:%s:%d", sim_target()->name, n);
+    }else{
+      snprintf(path, sizeof(path), "sim:%s", sim_target()->name);
+    }
+    info->path = strdup(path);
+    info->vendor_id = SIM_VID;
+    info->product_id = SIM_PID;
+    info->release_number = SIM_RELEASE;
+    info->serial_number = sim_serial(n);
+    info->manufacturer_string = wcsdup(L"www.serasidis.gr");
+    info->product_string = wcsdup(L"STM32F HID Bootloader (simulated)");
+    *last = info;
+    last = &info->next;
+  }
+  return devs;
+}
+
+void HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs) {
+  struct hid_device_info *next;
+
+  for(; devs; devs = next) {
+    next = devs->next;
+    free(devs->path);
+    free(devs->serial_number);
+    free(devs->manufacturer_string);
+    free(devs->product_string);
+    free(devs);
+  }
+}
+
+hid_device *hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number) {
+  if(vendor_id != SIM_VID || product_id != SIM_PID) {
+    return NULL;
+  }
+  return hid_open_path("sim");
+}
+
+// Keep a device whose link dropped, returns 0 if there is no room left
+static int unplug(hid_device *dev) {
+  int kept = 0;
+
+  pthread_mutex_lock(&unplugged_mutex);
+  for(int i = 0; i < MAX_UNPLUGGED && !kept; i++) {
+    if(!unplugged[i]) {
+      unplugged[i] = dev;
+      kept = 1;
+    }
+  }
+  pthread_mutex_unlock(&unplugged_mutex);
+  return kept;
+}
+
+// Device <index> enumerated again after its link dropped, or NULL. The
+// replies that were not read are lost.
+static hid_device *replug(int index) {
+  hid_device *dev = NULL;
+
+  pthread_mutex_lock(&unplugged_mutex);
+  for(int i = 0; i < MAX_UNPLUGGED && !dev; i++) {
+    if(unplugged[i] && unplugged[i]->index == index) {
+      dev = unplugged[i];
+      unplugged[i] = NULL;
+    }
+  }
+  pthread_mutex_unlock(&unplugged_mutex);
+  if(dev) {
+    dev->link_down = 0;
+    dev->blocking = 1;
+    dev->out_free = 0;
+    memset(dev->slot_free, 0, sizeof(dev->slot_free));
+    dev->reply_head = dev->reply_tail = 0;
+
+    // The F1 drops the page it was receiving on USB reset
+    if(!is_f4(dev)) {
+      dev->page_offset = 0;
+    }
+  }
+  return dev;
+}
+
+hid_device *HID_API_EXPORT hid_open_path(const char *path) {
+  hid_device *dev;
+  const char *env;
+  const char *index;
+  FILE *file;
+  uint32_t flash_kb;
+
+  if(strncmp(path, "sim", 3) != 0) {
+    return NULL;
+  }
+  index = strchr(path, ':');
+  index = index ? strchr(index + 1, ':') : NULL;
+  dev = replug(index ? atoi(index + 1) : 0);
+  if(dev) {
+    return dev;
+  }
+  dev = calloc(1, sizeof(*dev));
+  if(!dev) {
+    return NULL;
+  }
+  dev->target = sim_target();
+  dev->index = index ? atoi(index + 1) : 0;
+  env = getenv("HIDSIM_FLASH_KB");
+  flash_kb = env ? (uint32_t)atoi(env) : dev->target->flash_kb;
+  env = getenv("HIDSIM_FRAME_US");
+  dev->frame_us = env ? (uint32_t)atoi(env) : 1000;
+  if(dev->frame_us == 0) {
+    dev->frame_us = 1;
+  }
+  env = getenv("HIDSIM_DROP_ACK");
+  dev->drop_ack = env ? (uint32_t)atoi(env) : 0;
+  env = getenv("HIDSIM_DROP_LINK");
+  dev->drop_link = env ? (uint32_t)atoi(env) : 0;
+  dev->flash_pages = flash_kb * 1024 / HOST_PAGE_SIZE;
+  dev->erase_pages = (!is_f4(dev) && flash_kb > 128) ? 2 : 1;
+  dev->flash = malloc(dev->flash_pages * HOST_PAGE_SIZE);
+  if(dev->flash_pages <= first_page(dev) || !dev->flash) {
+    free(dev->flash);
+    free(dev);
+    return NULL;
+  }
+  memset(dev->flash, 0xFF, dev->flash_pages * HOST_PAGE_SIZE);
+  env = getenv("HIDSIM_FLASH");
+  if(env) {
+    dev->flash_file = malloc(strlen(env) + (index ? strlen(index) : 0) + 1);
+    if(dev->flash_file) {
+      strcpy(dev->flash_file, env);
+      if(index) {
+        strcat(dev->flash_file, ".");
+        strcat(dev->flash_file, index + 1);
+      }
+    }
+  }
+  if(dev->flash_file && (file = fopen(dev->flash_file, "rb")) != NULL) {
+    if(fread(dev->flash, 1, dev->flash_pages * HOST_PAGE_SIZE, file) == 0) {
+      printf("> [sim] %s is empty\n", dev->flash_file);
+    }
+    fclose(file);
+  }
+  dev->current_page = first_page(dev);
+  dev->blocking = 1;
+  return dev;
+}
+
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length) {
+  uint8_t report[REPORT_SIZE];
+  uint64_t now = sim_now();
+  uint64_t accept, done;
+
+  if(dev->rebooted || dev->link_down || length < 1) {
+    return -1;
+  }
+
+  // The first byte is the report ID
+  memset(report, 0, sizeof(report));
+  memcpy(report, data + 1, length - 1 < REPORT_SIZE ? length - 1 : REPORT_SIZE);
+
+  // The OUT endpoint takes one report per frame, and NAKs while the F4
+  // receive queue is full
+  accept = now > dev->out_free ? now : dev->out_free;
+  if(dev->target->rx_slots && accept < dev->slot_free[dev->reports % dev->target->rx_slots]) {
+    accept = dev->slot_free[dev->reports % dev->target->rx_slots];
+  }
+  if(accept > now + WRITE_TIMEOUT) {
+    sim_sleep_until(now + WRITE_TIMEOUT);
+    return -1;
+  }
+  sim_sleep_until(accept);
+
+  if(dev->target->rx_slots) {
+    done = f4_report(dev, report, accept);
+    dev->slot_free[dev->reports % dev->target->rx_slots] = done;
+    dev->out_free = accept + dev->frame_us;
+  }else{
+    done = f1_report(dev, report, accept);
+    dev->out_free = (done > accept ? done : accept) + dev->frame_us;
+  }
+  dev->reports++;
+  if(dev->reports == dev->drop_link) {
+    printf("\n> [sim] %s: USB link dropped\n", dev->target->name);
+    dev->link_down = 1;
+    dev->drop_link = 0;
+  }
+  return length;
+}
+
+// The model already lets the host send one report per frame
+int HID_API_EXPORT hid_write_async(hid_device *dev, const unsigned char *data, size_t length) {
+  return hid_write(dev, data, length);
+}
+
+int HID_API_EXPORT hid_write_flush(hid_device *dev, int milliseconds) {
+  return dev->link_down ? -1 : 0;
+}
+
+// The replies are queued without limit
+unsigned long HID_API_EXPORT hid_input_overflows(hid_device *dev) {
+  return 0;
+}
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds) {
+  uint64_t now = sim_now();
+  uint64_t timeout = milliseconds < 0 ? 1000000 : (uint64_t)milliseconds * 1000;
+  sim_reply_t *reply;
+  size_t size = dev->target->reply_size;
+
+  if(dev->link_down) {
+    return -1;
+  }
+  if(dev->reply_head == dev->reply_tail && dev->rebooted) {
+    return -1;
+  }
+
+  // The model runs ahead of the host: a reply that is not queued yet never
+  // comes
+  if(dev->reply_head == dev->reply_tail || dev->replies[dev->reply_head].ready > now + timeout) {
+    sim_sleep_until(now + timeout);
+    return 0;
+  }
+  reply = &dev->replies[dev->reply_head];
+  sim_sleep_until(reply->ready);
+  if(size > length) {
+    size = length;
+  }
+  memcpy(data, reply->data, size);
+  dev->reply_head = (dev->reply_head + 1) % MAX_REPLIES;
+  return size;
+}
+
+int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length) {
+  return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
+}
+
+int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock) {
+  dev->blocking = !nonblock;
+  return 0;
+}
+
+int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length) {
+  return -1;
+}
+
+int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length) {
+  return -1;
+}
+
+void HID_API_EXPORT hid_close(hid_device *dev) {
+  FILE *file;
+
+  if(!dev) {
+    return;
+  }
+  printf("> [sim] %s: %u reports, %u pages programmed (%u ms), %u erases (%u ms)",
+    dev->target->name, dev->reports, dev->pages_programmed, (uint32_t)(dev->program_us / 1000),
+    dev->erases, (uint32_t)(dev->erase_us / 1000));
+  if(dev->overruns || dev->lost_replies) {
+    printf(", %u page buffer overruns, %u lost replies", dev->overruns, dev->lost_replies);
+  }
+  printf("\n");
+  if(dev->flash_file && (file = fopen(dev->flash_file, "wb")) != NULL) {
+    fwrite(dev->flash, 1, dev->flash_pages * HOST_PAGE_SIZE, file);
+    fclose(file);
+  }
+  if(dev->link_down && unplug(dev)) {
+    return;
+  }
+  free(dev->flash_file);
+  free(dev->flash);
+  free(dev);
+}
+
+int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen) {
+  return hid_get_indexed_string(dev, 1, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_product_string(hid_device *dev, wchar_t *string, size_t maxlen) {
+  return hid_get_indexed_string(dev, 2, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev, wchar_t *string, size_t maxlen) {
+  wchar_t *serial;
+
+  if(maxlen == 0 || (serial = sim_serial(dev->index)) == NULL) {
+    return -1;
+  }
+  wcsncpy(string, serial, maxlen);
+  string[maxlen - 1] = 0;
+  free(serial);
+  return 0;
+}
+
+int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen) {
+  const wchar_t *value;
+
+  switch(string_index) {
+    case 1:
+      value = L"www.serasidis.gr";
+      break;
+    case 2:
+      value = L"STM32F HID Bootloader (simulated)";
+      break;
+    default:
+      return -1;
+  }
+  if(maxlen == 0) {
+    return -1;
+  }
+  wcsncpy(string, value, maxlen);
+  string[maxlen - 1] = 0;
+  return 0;
+}
+
+HID_API_EXPORT const wchar_t *HID_API_CALL hid_error(hid_device *dev) {
+  return NULL;
+}
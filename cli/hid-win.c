@@ -663,6 +663,24 @@ end_of_function:
   return bytes_written;
 }
 
+/* Reports are not queued on this platform: each one is sent before
+   returning, so there is nothing left to flush. */
+int HID_API_EXPORT HID_API_CALL hid_write_async(hid_device *dev, const unsigned char *data, size_t length)
+{
+  return hid_write(dev, data, length);
+}
+
+int HID_API_EXPORT HID_API_CALL hid_write_flush(hid_device *dev, int milliseconds)
+{
+  return 0;
+}
+
+/* Dropped input reports are not counted on this platform. */
+unsigned long HID_API_EXPORT HID_API_CALL hid_input_overflows(hid_device *dev)
+{
+  return 0;
+}
+
 
 int HID_API_EXPORT HID_API_CALL hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
 {
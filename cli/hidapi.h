@@ -202,6 +202,56 @@ extern "C" {
     */
     int  HID_API_EXPORT HID_API_CALL hid_write(hid_device *device, const unsigned char *data, size_t length);
 
+    /** @brief Queue an Output report to a HID device.
+
+      Like hid_write(), but returns as soon as the report is queued,
+      so that the next report can be sent in the next frame. Up to a
+      fixed number of reports are queued at once: beyond that, it waits
+      for the oldest one to be sent. Reports are sent in order. The
+      libusb backend queues the reports on the interrupt OUT endpoint;
+      the other backends send them with hid_write().
+
+      @ingroup API
+      @param device A device handle returned from hid_open().
+      @param data The data to send, including the report number as
+        the first byte.
+      @param length The length in bytes of the data to send.
+
+      @returns
+        This function returns @p length once the report is queued,
+        and -1 on error, including the failure of a report queued
+        before and not flushed yet.
+    */
+    int  HID_API_EXPORT HID_API_CALL hid_write_async(hid_device *device, const unsigned char *data, size_t length);
+
+    /** @brief Wait for the reports queued with hid_write_async() to be sent.
+
+      @ingroup API
+      @param device A device handle returned from hid_open().
+      @param milliseconds timeout in milliseconds or -1 for blocking wait.
+
+      @returns
+        This function returns 0 once all the queued reports are sent,
+        and -1 if one of them failed or the timeout expired.
+    */
+    int  HID_API_EXPORT HID_API_CALL hid_write_flush(hid_device *device, int milliseconds);
+
+    /** @brief Number of input reports dropped because they were not
+      read in time.
+
+      The libusb and Mac backends keep a bounded queue of received input
+      reports, and drop the oldest one when a new report arrives while
+      it is full. The other backends do not count dropped reports.
+
+      @ingroup API
+      @param device A device handle returned from hid_open().
+
+      @returns
+        This function returns the number of input reports dropped
+        since the device was opened.
+    */
+    unsigned long HID_API_EXPORT HID_API_CALL hid_input_overflows(hid_device *device);
+
     /** @brief Read an Input report from a HID device with timeout.
 
       Input reports are returned
@@ -0,0 +1,138 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include "image.h"
+
+#define MAX_IMAGE_SIZE  (64 * 1024 * 1024) // far more than any STM32 flash
+#define READ_CHUNK      (64 * 1024)
+
+// Map a regular file. The system fills the end of the last memory page of
+// the mapping with zeros, which pads the image up to a whole flash page as
+// long as memory pages are a multiple of it.
+// Returns 0 if the file cannot be mapped.
+static int map_file(image_t *image, const char *path, uint32_t page_size) {
+#ifdef _WIN32
+  return 0;
+#else
+  struct stat st;
+  long memory_page = sysconf(_SC_PAGESIZE);
+  void *mapping;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    return 0;
+  }
+  if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size > MAX_IMAGE_SIZE ||
+     memory_page <= 0 || memory_page % page_size != 0) {
+    close(fd);
+    return 0;
+  }
+  image->size = st.st_size;
+  image->pages = (image->size + page_size - 1) / page_size;
+  image->mapping_size = (size_t)image->pages * page_size;
+  mapping = mmap(NULL, image->mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapping == MAP_FAILED) {
+    return 0;
+  }
+  image->mapping = mapping;
+  image->data = mapping;
+  return 1;
+#endif
+}
+
+// Read a whole stream (stdin, pipe) into a buffer, padded with zeros up to
+// a whole page. Returns 0 on read error or if it does not fit in memory.
+static int read_stream(image_t *image, FILE *file, uint32_t page_size) {
+  uint8_t *buffer = NULL;
+  uint8_t *grown;
+  size_t size = 0;
+  size_t allocated = 0;
+  size_t n;
+
+  do {
+    // Always leave room for the padding
+    if(allocated - size < page_size) {
+      allocated = allocated ? allocated * 2 : READ_CHUNK;
+      grown = allocated <= MAX_IMAGE_SIZE ? realloc(buffer, allocated) : NULL;
+      if(!grown) {
+        free(buffer);
+        return 0;
+      }
+      buffer = grown;
+    }
+    n = fread(buffer + size, 1, allocated - size, file);
+    size += n;
+  } while(n > 0);
+  if(ferror(file)) {
+    free(buffer);
+    return 0;
+  }
+  image->size = size;
+  image->pages = (size + page_size - 1) / page_size;
+  memset(buffer + size, 0, image->pages * page_size - size);
+  image->buffer = buffer;
+  image->data = buffer;
+  return 1;
+}
+
+// Open the image at <path>, "-" for stdin. Returns 0 if it cannot be read.
+int image_open(image_t *image, const char *path, uint32_t page_size) {
+  FILE *file;
+  int ok;
+
+  memset(image, 0, sizeof(*image));
+  if(strcmp(path, "-") == 0) {
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    return read_stream(image, stdin, page_size);
+  }
+  if(map_file(image, path, page_size)) {
+    return 1;
+  }
+  file = fopen(path, "rb");
+  if(!file) {
+    return 0;
+  }
+  ok = read_stream(image, file, page_size);
+  fclose(file);
+  return ok;
+}
+
+void image_close(image_t *image) {
+#ifndef _WIN32
+  if(image->mapping) {
+    munmap(image->mapping, image->mapping_size);
+  }
+#endif
+  free(image->buffer);
+  memset(image, 0, sizeof(*image));
+}
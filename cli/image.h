@@ -0,0 +1,41 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#ifndef image_INCLUDED
+#define image_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Firmware image, read-only once opened, and shared by the devices being
+// flashed. Regular files are mapped in memory; stdin, pipes and systems
+// without mmap() read the whole stream into a buffer first. Either way,
+// the size is known before the upload starts.
+typedef struct {
+  const uint8_t *data;   // padded with zeros up to a whole page
+  uint32_t size;
+  uint32_t pages;
+  void *mapping;         // mmap()ed file, or NULL
+  size_t mapping_size;
+  uint8_t *buffer;       // streamed image, or NULL
+} image_t;
+
+int image_open(image_t *image, const char *path, uint32_t page_size);
+void image_close(image_t *image);
+
+#endif
@@ -0,0 +1,177 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+// Greedy LZ4 block compressor: each position is looked up in a hash table
+// of the last position of its 4 first bytes. Good enough for 1 KB pages.
+
+#include <string.h>
+#include "lz4.h"
+
+#define HASH_BITS      12
+#define MIN_MATCH       4
+#define LAST_LITERALS   5 // The block ends with at least 5 literals
+#define MATCH_LIMIT    12 // and no match starts in its last 12 bytes
+
+static uint32_t read32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int hash32(uint32_t sequence) {
+  return (sequence * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Append a length extension, returns the new output position or -1
+static int put_length(uint8_t *dst, int op, int dst_size, int len) {
+  for(; len >= 255; len -= 255) {
+    if(op >= dst_size) {
+      return -1;
+    }
+    dst[op++] = 255;
+  }
+  if(op >= dst_size) {
+    return -1;
+  }
+  dst[op++] = len;
+  return op;
+}
+
+// Append a sequence: literals, then a match (none if <match_len> is 0)
+static int put_sequence(uint8_t *dst, int op, int dst_size, const uint8_t *literals, int literal_len,
+                        int offset, int match_len) {
+  if(op >= dst_size) {
+    return -1;
+  }
+  dst[op++] = ((literal_len < 15 ? literal_len : 15) << 4) |
+              (match_len == 0 ? 0 : (match_len - MIN_MATCH < 15 ? match_len - MIN_MATCH : 15));
+  if(literal_len >= 15 && (op = put_length(dst, op, dst_size, literal_len - 15)) < 0) {
+    return -1;
+  }
+  if(op + literal_len > dst_size) {
+    return -1;
+  }
+  memcpy(dst + op, literals, literal_len);
+  op += literal_len;
+
+  if(match_len == 0) {
+    return op;
+  }
+  if(op + 2 > dst_size) {
+    return -1;
+  }
+  dst[op++] = offset;
+  dst[op++] = offset >> 8;
+  if(match_len - MIN_MATCH >= 15) {
+    op = put_length(dst, op, dst_size, match_len - MIN_MATCH - 15);
+  }
+  return op;
+}
+
+int lz4_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_size) {
+  uint16_t table[1 << HASH_BITS]; // position + 1, 0 if none
+  int ip = 0;
+  int anchor = 0;
+  int op = 0;
+  int ref, h, len;
+  uint32_t sequence;
+
+  memset(table, 0, sizeof(table));
+  while(ip < src_len - MATCH_LIMIT) {
+    sequence = read32(src + ip);
+    h = hash32(sequence);
+    ref = table[h] - 1;
+    table[h] = ip + 1;
+    if(ref < 0 || read32(src + ref) != sequence) {
+      ip++;
+      continue;
+    }
+
+    len = MIN_MATCH;
+    while(ip + len < src_len - LAST_LITERALS && src[ref + len] == src[ip + len]) {
+      len++;
+    }
+    op = put_sequence(dst, op, dst_size, src + anchor, ip - anchor, ip - ref, len);
+    if(op < 0) {
+      return 0;
+    }
+    ip += len;
+    anchor = ip;
+  }
+
+  op = put_sequence(dst, op, dst_size, src + anchor, src_len - anchor, 0, 0);
+  return op < 0 ? 0 : op;
+}
+
+// Add the length extension bytes to <len>. Returns 0 past the end of the
+// input.
+static int get_length(const uint8_t *src, int *ip, int src_len, int *len) {
+  uint8_t byte;
+
+  do {
+    if(*ip >= src_len) {
+      return 0;
+    }
+    byte = src[(*ip)++];
+    *len += byte;
+  } while(byte == 255);
+  return 1;
+}
+
+int lz4_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_size) {
+  int ip = 0;
+  int op = 0;
+  int len, offset;
+  uint8_t token;
+
+  while(ip < src_len) {
+    token = src[ip++];
+
+    len = token >> 4;
+    if(len == 15 && !get_length(src, &ip, src_len, &len)) {
+      return -1;
+    }
+    if(len > src_len - ip || len > dst_size - op) {
+      return -1;
+    }
+    memcpy(dst + op, src + ip, len);
+    op += len;
+    ip += len;
+
+    // The last sequence has no match
+    if(ip == src_len) {
+      break;
+    }
+
+    // The match may overlap the bytes it produces
+    if(src_len - ip < 2) {
+      return -1;
+    }
+    offset = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+    len = (token & 15) + MIN_MATCH;
+    if((token & 15) == 15 && !get_length(src, &ip, src_len, &len)) {
+      return -1;
+    }
+    if(offset == 0 || offset > op || len > dst_size - op) {
+      return -1;
+    }
+    for(; len > 0; len--, op++) {
+      dst[op] = dst[op - offset];
+    }
+  }
+  return op;
+}
@@ -0,0 +1,32 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#ifndef lz4_INCLUDED
+#define lz4_INCLUDED
+
+#include <stdint.h>
+
+// Compress <src_len> bytes (at most 64 KB) into one LZ4 block.
+// Returns the block size, or 0 if it does not fit in <dst_size> bytes.
+int lz4_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_size);
+
+// Decompress one LZ4 block. Returns the decompressed size, or -1 if the
+// block is malformed or does not fit in <dst_size> bytes.
+int lz4_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_size);
+
+#endif
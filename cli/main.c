@@ -23,213 +23,1167 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <strings.h>
+#include <wchar.h>
+#include <pthread.h>
 #include "rs232.h"
 #include "hidapi.h"
+#include "pacing.h"
+#include "stats.h"
+#include "lz4.h"
+#include "image.h"
 
 #define SECTOR_SIZE  1024
 #define HID_TX_SIZE    65
-#define HID_RX_SIZE     9
+#define HID_RX_SIZE    65
 
 #define VID           0x1209
 #define PID           0xBEBA
 #define FIRMWARE_VER  0x0300
+#define PROTOCOL_VER  0x0310 // First firmware with <get info> and page windows
+
+#define CMD_PAGE_WRITTEN  0x02
+#define CMD_GET_INFO      0x03
+#define CMD_GET_CRC       0x04
+#define CMD_SET_PAGE      0x05
+#define CMD_VERIFY        0x06
+#define CMD_ERASING       0x07
+#define CMD_ERASE         0x08
+#define CMD_GET_PROGRESS  0x09
+
+#define CAP_PAGE_CRC      0x0001
+#define CAP_VERIFY        0x0002
+#define CAP_BLANK_CHIP    0x0004
+#define CAP_LZ4           0x0008
+#define CAP_ERASE_AHEAD   0x0010
+#define CAP_ERASE         0x0020
+#define CAP_PROGRESS      0x0040
+
+#define RESET_BLANK_CHIP  0x01
+#define RESET_LZ4         0x02
+
+#define LZ4_HEADER_SIZE   2
+#define LZ4_MAX_BLOCK     (SECTOR_SIZE - LZ4_HEADER_SIZE - 1)
+
+#define MAX_WINDOW     16
+#define MAX_SELECTORS  16  // --serial and --path options
+#define MAX_ERASES     8   // <erase> commands queued in the device at once
+#define PACKET_SIZE    (SECTOR_SIZE + HID_TX_SIZE - 1) // largest packed page
+
+#define REPLY_TIMEOUT  1000 // ms
+#define ERASE_TIMEOUT  5000 // ms, longer than any sector erase
+#define ACK_TIMEOUT    5000 // ms, a page write may erase its sector first
+#define MAX_RESENDS    3    // acknowledge timeouts before giving up
+#define MAX_RESUMES    3    // USB link drops before giving up
+#define RECONNECT_TIME 10   // s, to find the device again after a link drop
 
 int serial_init(char *argument, uint8_t __timer);
 
+typedef struct {
+  int window;            // pages the host may send ahead of the acknowledges
+  int page_size;         // flash page size
+  int poll_interval;     // OUT endpoint polling interval (ms)
+  uint16_t capabilities; // CAP_* flags
+} device_info_t;
+
+typedef struct {
+  int window;
+  int full;
+  int blank;
+  int lz4;
+  const char *serials[MAX_SELECTORS]; // only flash these devices, if any
+  int n_serials;
+  const char *paths[MAX_SELECTORS];
+  int n_paths;
+} options_t;
+
+// One device to flash. With --all, each device is flashed on its own thread.
+typedef struct {
+  const image_t *image;
+  const options_t *options;
+  char *path;
+  char *serial;          // USB serial number (bootloader chip UID), or NULL
+  uint16_t firmware_ver;
+  int number;            // 1, 2... with --all, 0 for a single device
+  hid_device *handle;
+  pthread_t thread;
+  stats_t stats;
+  int error;
+} job_t;
+
+// Number of the device flashed by the calling thread, 0 for a single device
+static __thread int device_number;
+
+// Print a "> " message, tagged with the device number with --all
+static void msg(const char *format, ...) {
+  char line[256];
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if(device_number) {
+    printf("> [%d] %s", device_number, line[0] == '\n' ? line + 1 : line);
+  }else if(line[0] == '\n') {
+    printf("\n> %s", line + 1);
+  }else{
+    printf("> %s", line);
+  }
+}
+
+static uint32_t get_le32(const uint8_t *buffer) {
+  return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+static void put_le32(uint8_t *buffer, uint32_t value) {
+  buffer[0] = value;
+  buffer[1] = value >> 8;
+  buffer[2] = value >> 16;
+  buffer[3] = value >> 24;
+}
+
+// CRC32 as computed by the STM32 CRC unit: Ethernet polynomial, not
+// reflected, fed with little endian 32-bit words.
+static uint32_t crc32_word(uint32_t crc, uint32_t word) {
+  crc ^= word;
+  for(int i = 0; i < 32; i++) {
+    crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+  }
+  return crc;
+}
+
 
-static int usb_write(hid_device *device, uint8_t *buffer, int len) {
+static int usb_write(hid_device *device, pacing_t *pacing, uint8_t *buffer, int len) {
   int retries = 20;
   int retval;
+  uint64_t start;
 
-  while(((retval = hid_write(device, buffer, len)) < len) && --retries) {
-    if(retval < 0) {
-      usleep(100 * 1000); // No data has been sent here. Delay and retry.
-    } else {
+  while(1) {
+    start = pacing_report_start(pacing);
+    retval = hid_write(device, buffer, len);
+    if(retval >= len) {
+      pacing_report_done(pacing, start);
+      return 1;
+    }
+    if(retval >= 0) {
       return 0; // Partial data has been sent. Firmware will be corrupted. Abort process.
     }
+    if(--retries == 0) {
+      return 0;
+    }
+    pacing_report_failed(pacing); // No data has been sent here. Back off and retry.
   }
+}
+
+// Queue a report with hid_write_async(). Queued reports cannot be retried
+// one by one: if one fails, this or a later call fails, or the next
+// hid_write_flush(), and the upload is aborted.
+static int usb_write_async(hid_device *device, pacing_t *pacing, uint8_t *buffer, int len) {
+  uint64_t start = pacing_report_start(pacing);
 
-  if(retries <= 0) {
+  if(hid_write_async(device, buffer, len) < len) {
     return 0;
   }
+  pacing_report_done(pacing, start);
+  return 1;
+}
 
+// Send a command with its two arguments
+static int send_command(hid_device *device, pacing_t *pacing, uint8_t *hid_tx_buf, uint8_t code, uint32_t arg0, uint32_t arg1) {
+  memset(hid_tx_buf, 0, HID_TX_SIZE);
+  memcpy(&hid_tx_buf[1], "BTLDCMD", 7);
+  hid_tx_buf[8] = code;
+  put_le32(&hid_tx_buf[9], arg0);
+  put_le32(&hid_tx_buf[13], arg1);
+  return usb_write(device, pacing, hid_tx_buf, HID_TX_SIZE);
+}
+
+// Wait up to <timeout> ms for the reply to a command
+static int read_reply(hid_device *device, uint8_t *hid_rx_buf, uint8_t code, int timeout) {
+  do {
+    memset(hid_rx_buf, 0, HID_RX_SIZE);
+    if(hid_read_timeout(device, hid_rx_buf, HID_RX_SIZE, timeout) <= 0) {
+      return 0;
+    }
+  } while(hid_rx_buf[7] != code);
   return 1;
 }
 
-int main(int argc, char *argv[]) {
-  uint8_t page_data[SECTOR_SIZE];
+// Wait for a <page written> reply, skipping the others, up to <timeout>
+// ms in all. Returns 1 once received, 0 on timeout, -1 on error.
+static int wait_page_written(hid_device *device, uint8_t *hid_rx_buf, int timeout) {
+  uint64_t deadline = pacing_now() + timeout * 1000ull;
+  uint64_t now;
+  int retval;
+
+  do {
+    now = pacing_now();
+    if(now >= deadline) {
+      return 0;
+    }
+    memset(hid_rx_buf, 0, HID_RX_SIZE);
+    retval = hid_read_timeout(device, hid_rx_buf, HID_RX_SIZE, (deadline - now + 999) / 1000);
+    if(retval <= 0) {
+      return retval;
+    }
+  } while(hid_rx_buf[7] != CMD_PAGE_WRITTEN);
+  return 1;
+}
+
+// Ask the bootloader for its protocol version, page window, capabilities
+// and the polling interval of its OUT endpoint (ms).
+// Returns 0 if the device did not answer.
+static int get_device_info(hid_device *device, pacing_t *pacing, uint8_t *hid_tx_buf, uint8_t *hid_rx_buf, device_info_t *info) {
+  if(!send_command(device, pacing, hid_tx_buf, CMD_GET_INFO, 0, 0) ||
+     !read_reply(device, hid_rx_buf, CMD_GET_INFO, REPLY_TIMEOUT)) {
+    return 0;
+  }
+
+  info->window = hid_rx_buf[9];
+  info->page_size = hid_rx_buf[10] | (hid_rx_buf[11] << 8);
+  info->capabilities = hid_rx_buf[12] | (hid_rx_buf[13] << 8);
+  info->poll_interval = hid_rx_buf[14];
+  msg("Bootloader protocol v%d, %d bytes flash pages, %d pages window, %d ms polling\n",
+    hid_rx_buf[8], info->page_size, info->window, info->poll_interval);
+  return 1;
+}
+
+// Wait for the device to erase the sectors of the image announced with
+// <reset pages>. It reports the time left before each sector, and 0 ms
+// once done. Returns 0 if it stops answering.
+static int wait_erase(hid_device *device, uint8_t *hid_rx_buf) {
+  uint32_t time_left;
+
+  do {
+    if(!read_reply(device, hid_rx_buf, CMD_ERASING, ERASE_TIMEOUT)) {
+      return 0;
+    }
+    time_left = get_le32(&hid_rx_buf[8]);
+    if(!device_number) {
+      printf("\r> Erasing, %u ms remaining   ", time_left);
+    }
+  } while(time_left > 0);
+  if(!device_number) {
+    printf("\n");
+  }
+  return 1;
+}
+
+// Ask the device to erase the flash sectors of the pages flagged in
+// <erase>, one <erase> command per run of pages. The device erases them
+// while the host goes on, so only wait once MAX_ERASES are pending.
+// Returns the number of commands still pending, or -1 on error.
+static int send_erases(hid_device *device, pacing_t *pacing, uint8_t *hid_tx_buf, uint8_t *hid_rx_buf,
+                       const uint8_t *erase, uint32_t image_pages) {
+  uint32_t page = 0;
+  uint32_t first;
+  int pending = 0;
+
+  while(page < image_pages) {
+    if(!erase[page]) {
+      page++;
+      continue;
+    }
+    for(first = page; page < image_pages && erase[page]; page++) {
+      ;
+    }
+    if(pending == MAX_ERASES) {
+      if(!wait_erase(device, hid_rx_buf)) {
+        return -1;
+      }
+      pending--;
+    }
+    if(!send_command(device, pacing, hid_tx_buf, CMD_ERASE, first, page - first)) {
+      return -1;
+    }
+    pending++;
+  }
+  return pending;
+}
+
+// Expected CRC of <count> pages from <first> once the image is flashed:
+// the image is padded with zeros up to a whole page, the pages past its
+// end are left erased.
+static uint32_t image_crc(const uint8_t *image, uint32_t image_pages, uint32_t first, uint32_t count) {
+  uint32_t crc = 0xFFFFFFFF;
+  uint32_t offset;
+
+  for(offset = first * SECTOR_SIZE; offset < (first + count) * SECTOR_SIZE; offset += 4) {
+    if(offset < image_pages * SECTOR_SIZE) {
+      crc = crc32_word(crc, get_le32(image + offset));
+    }else{
+      crc = crc32_word(crc, 0xFFFFFFFF);
+    }
+  }
+  return crc;
+}
+
+// Ask the device for the CRC of the flashed image and compare it with the
+// image's own CRC. Returns 0 if they differ or the device did not answer.
+static int verify_image(hid_device *device, pacing_t *pacing, uint8_t *hid_tx_buf, uint8_t *hid_rx_buf,
+                        const uint8_t *image, uint32_t image_size) {
+  uint32_t crc = 0xFFFFFFFF;
+  uint32_t offset;
+
+  // The image is padded with zeros, so the last word is complete
+  for(offset = 0; offset < image_size; offset += 4) {
+    crc = crc32_word(crc, get_le32(image + offset));
+  }
+
+  if(!send_command(device, pacing, hid_tx_buf, CMD_VERIFY, image_size, 0) ||
+     !read_reply(device, hid_rx_buf, CMD_VERIFY, REPLY_TIMEOUT)) {
+    msg("Error while sending <verify> command.\n");
+    return 0;
+  }
+  if(get_le32(&hid_rx_buf[12]) != image_size || get_le32(&hid_rx_buf[8]) != crc) {
+    msg("Verification failed: flash CRC %08X, firmware file CRC %08X\n",
+      get_le32(&hid_rx_buf[8]), crc);
+    return 0;
+  }
+  msg("Verified, CRC %08X\n", crc);
+  return 1;
+}
+
+// Build the bytes sent for a page of a compressed upload, padded to whole
+// reports, and return their size. The page is preceded by its LZ4 block
+// length, or sent as is when it does not compress to fewer reports. A page
+// sent as is only starts with a 0 length when its first 2 bytes would read
+// as a block length. Uncompressed uploads send the pages straight from the
+// image.
+static int pack_page(const uint8_t *page_data, uint8_t *packet) {
+  int size;
+
+  memset(packet, 0, PACKET_SIZE);
+  size = lz4_compress(page_data, SECTOR_SIZE, packet + LZ4_HEADER_SIZE,
+    SECTOR_SIZE - (HID_TX_SIZE - 1) - LZ4_HEADER_SIZE);
+  if(size > 0) {
+    packet[0] = size;
+    packet[1] = size >> 8;
+    size += LZ4_HEADER_SIZE;
+  }else if((page_data[0] | (page_data[1] << 8)) > LZ4_MAX_BLOCK) {
+    memcpy(packet, page_data, SECTOR_SIZE);
+    size = SECTOR_SIZE;
+  }else{
+    memcpy(packet + LZ4_HEADER_SIZE, page_data, SECTOR_SIZE);
+    size = SECTOR_SIZE + LZ4_HEADER_SIZE;
+  }
+  return (size + HID_TX_SIZE - 2) / (HID_TX_SIZE - 1) * (HID_TX_SIZE - 1);
+}
+
+static int page_is_erased(const uint8_t *image, uint32_t page) {
+  for(int i = 0; i < SECTOR_SIZE; i++) {
+    if(image[page * SECTOR_SIZE + i] != 0xFF) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Flag the pages of a changed erase unit: the device erases it when the
+// first page inside it is written, so the erased pages of the image (0xFF
+// gap fill) are skipped, unless the whole unit is. Returns the number of
+// pages flagged.
+static int flag_unit(const uint8_t *image, uint32_t image_pages, uint32_t first, uint32_t count,
+                     uint8_t *changed, uint8_t *erase) {
+  int n_unit = 0;
+
+  for(uint32_t page = first; page < first + count && page < image_pages; page++) {
+    erase[page] = 1;
+    if(!page_is_erased(image, page)) {
+      changed[page] = 1;
+      n_unit++;
+    }
+  }
+  if(n_unit == 0) {
+    changed[first] = 1;
+    n_unit++;
+  }
+  return n_unit;
+}
+
+// Compare the image with the device flash, one erase unit at a time,
+// and flag the pages that need to be written (all of them if <full>).
+// All the pages of a changed unit are flagged in <erase>.
+// Returns the number of pages to write, or -1 on error.
+static int find_changed_pages(hid_device *device, pacing_t *pacing, uint8_t *hid_tx_buf, uint8_t *hid_rx_buf,
+                              const uint8_t *image, uint32_t image_pages, int full, uint8_t *changed,
+                              uint8_t *erase) {
+  uint32_t page = 0;
+  uint32_t first, count;
+  int n_changed = 0;
+
+  while(page < image_pages) {
+    if(!send_command(device, pacing, hid_tx_buf, CMD_GET_CRC, page, 1) ||
+       !read_reply(device, hid_rx_buf, CMD_GET_CRC, REPLY_TIMEOUT)) {
+      msg("Error while sending <get crc> command.\n");
+      return -1;
+    }
+
+    // The device extends the range to the pages it erases together
+    first = hid_rx_buf[12] | (hid_rx_buf[13] << 8);
+    count = hid_rx_buf[14] | (hid_rx_buf[15] << 8);
+    if(count == 0 || first > page) {
+      msg("Firmware file is larger than the device flash.\n");
+      return -1;
+    }
+    if(full || image_crc(image, image_pages, first, count) != get_le32(&hid_rx_buf[8])) {
+      n_changed += flag_unit(image, image_pages, first, count, changed, erase);
+    }
+    page = first + count;
+  }
+  return n_changed;
+}
+
+// USB serial number as a C string, NULL if the device has none. Bootloaders
+// report the chip unique ID in hex, so plain ASCII is enough.
+static char *serial_string(const wchar_t *serial_number) {
+  char *serial;
+  size_t i, length;
+
+  if(!serial_number || !serial_number[0]) {
+    return NULL;
+  }
+  length = wcslen(serial_number);
+  serial = malloc(length + 1);
+  if(serial) {
+    for(i = 0; i < length; i++) {
+      serial[i] = serial_number[i] < 0x80 ? serial_number[i] : '?';
+    }
+    serial[length] = 0;
+  }
+  return serial;
+}
+
+// Whether a device matches the --serial and --path selectors. With none,
+// every device does.
+static int device_selected(const options_t *options, struct hid_device_info *device) {
+  char *serial;
+  int i, selected = 0;
+
+  if(options->n_serials == 0 && options->n_paths == 0) {
+    return 1;
+  }
+  for(i = 0; i < options->n_paths && !selected; i++) {
+    selected = device->path && strcmp(options->paths[i], device->path) == 0;
+  }
+  serial = serial_string(device->serial_number);
+  for(i = 0; i < options->n_serials && serial && !selected; i++) {
+    selected = strcasecmp(options->serials[i], serial) == 0;
+  }
+  free(serial);
+  return selected;
+}
+
+// Find the device again after the USB link dropped. Its path may change
+// when it is enumerated again, so it is found by its serial number.
+// Returns NULL if it does not come back within RECONNECT_TIME seconds.
+static hid_device *reconnect(job_t *job) {
+  struct hid_device_info *devs, *cur_dev;
+  hid_device *handle = NULL;
+  char *serial;
+
+  for(int i = 0; i < RECONNECT_TIME && !handle; i++) {
+    sleep(1);
+    devs = hid_enumerate(VID, PID);
+    for(cur_dev = devs; cur_dev && !handle; cur_dev = cur_dev->next) {
+      serial = serial_string(cur_dev->serial_number);
+      if(serial && strcmp(serial, job->serial) == 0) {
+        handle = hid_open_path(cur_dev->path);
+        if(handle) {
+          free(job->path);
+          job->path = strdup(cur_dev->path);
+        }
+      }
+      free(serial);
+    }
+    hid_free_enumeration(devs);
+  }
+  return handle;
+}
+
+// Prepare the upload to resume after a link drop. The device reports the
+// page after the last one it wrote: the erase units up to there are
+// checked by CRC, and only those that differ from the image are flagged
+// to be written again. The pages past it keep their flags.
+// Returns the number of pages to write, or -1 on error.
+static int resume_pages(hid_device *device, pacing_t *pacing, uint8_t *hid_tx_buf, uint8_t *hid_rx_buf,
+                        const uint8_t *image, uint32_t image_pages, uint8_t *changed, uint8_t *erase) {
+  uint32_t written, page, first, count;
+  int n_changed = 0;
+
+  if(!send_command(device, pacing, hid_tx_buf, CMD_GET_PROGRESS, 0, 0) ||
+     !read_reply(device, hid_rx_buf, CMD_GET_PROGRESS, REPLY_TIMEOUT)) {
+    msg("Error while sending <get progress> command.\n");
+    return -1;
+  }
+  written = get_le32(&hid_rx_buf[12]);
+  msg("Device wrote %u pages, up to page %u\n", get_le32(&hid_rx_buf[8]), written);
+
+  for(page = 0; page < written && page < image_pages; page = first + count) {
+    if(!send_command(device, pacing, hid_tx_buf, CMD_GET_CRC, page, 1) ||
+       !read_reply(device, hid_rx_buf, CMD_GET_CRC, REPLY_TIMEOUT)) {
+      msg("Error while sending <get crc> command.\n");
+      return -1;
+    }
+    first = hid_rx_buf[12] | (hid_rx_buf[13] << 8);
+    count = hid_rx_buf[14] | (hid_rx_buf[15] << 8);
+    if(count == 0 || first > page) {
+      return -1;
+    }
+    for(uint32_t i = first; i < first + count && i < image_pages; i++) {
+      changed[i] = erase[i] = 0;
+    }
+    if(image_crc(image, image_pages, first, count) != get_le32(&hid_rx_buf[8])) {
+      flag_unit(image, image_pages, first, count, changed, erase);
+    }
+  }
+  for(page = 0; page < image_pages; page++) {
+    n_changed += changed[page];
+  }
+  return n_changed;
+}
+
+// Flash the image to one device: compare, erase, send the pages, verify
+// and reboot. Runs on its own thread with --all.
+static void *flash_device(void *arg) {
+  job_t *job = arg;
+  const image_t *image = job->image;
+  hid_device *handle = job->handle;
+  stats_t *stats = &job->stats;
+  uint8_t *changed = NULL;
+  uint8_t *erase = NULL;
+  uint8_t *packets = NULL;
+  uint16_t *packet_sizes = NULL;
+  uint32_t page = 0;
+  uint32_t next_page = 0;
+  int n_changed = image->pages;
+  int erases_pending = 0;
+  int lz4 = job->options->lz4;
+  int async = 0;
+  int window = job->options->window;
+  const uint8_t *packet;
+  int packet_size;
+  uint32_t wire_bytes = 0;
   uint8_t hid_tx_buf[HID_TX_SIZE];
   uint8_t hid_rx_buf[HID_RX_SIZE];
   uint8_t CMD_RESET_PAGES[8] = {'B','T','L','D','C','M','D', 0x00};
   uint8_t CMD_REBOOT_MCU[8] = {'B','T','L','D','C','M','D', 0x01};
-  hid_device *handle = NULL;
-  size_t read_bytes;
-  FILE *firmware_file = NULL;
   int error = 0;
   uint32_t n_bytes = 0;
+  device_info_t info;
+  pacing_t pacing;
+  uint64_t sent_at[MAX_WINDOW];
+  uint32_t sent_page[MAX_WINDOW];
+  uint32_t acked;
+  uint32_t ack_base = 0;
+  uint32_t first;
+  int resends = 0;
+  int resumes = 0;
+  int retval;
+  uint32_t pages_sent = 0;
+  uint32_t pages_acked = 0;
+  uint64_t t;
+
+  device_number = job->number;
+
+  changed = calloc(image->pages + 1, 1);
+  erase = calloc(image->pages + 1, 1);
+  if(!changed || !erase) {
+    msg("Out of memory\n");
+    error = 1;
+    goto exit;
+  }
+
+  // Start with a short delay between reports sent as control transfers
+  pacing_init(&pacing, 500);
+  t = pacing_now();
+
+  // Firmware older than v3.10 acknowledges each page and cannot be
+  // sent the next one before.
+  if(job->firmware_ver >= PROTOCOL_VER) {
+    if(!get_device_info(handle, &pacing, hid_tx_buf, hid_rx_buf, &info)) {
+      msg("Error while sending <get info> command.\n");
+      error = 1;
+      goto exit;
+    }
+    if(window > info.window) {
+      window = info.window;
+    }
+
+    // Reports go through the interrupt OUT endpoint, so hid_write() already
+    // returns at the pace the device polls it. Pacing only slows down if
+    // the device fails to keep up. Page data is queued, so that the host
+    // controller has a report to send in every frame.
+    if(info.poll_interval > 0) {
+      pacing.report_delay = 0;
+      async = 1;
+    }
+  }else{
+    window = 1;
+    info.capabilities = 0;
+  }
+
+  // Only write the pages that differ from the device flash, and skip the
+  // erased ones. There is nothing to compare with on a blank chip.
+  memset(erase, 1, image->pages);
+  if(!(info.capabilities & CAP_PAGE_CRC)) {
+    memset(changed, 1, image->pages);
+  }else{
+    if(job->options->blank) {
+      for(n_changed = 0, page = 0; page < image->pages; page++) {
+        changed[page] = !page_is_erased(image->data, page);
+        n_changed += changed[page];
+      }
+      page = 0;
+    }else{
+      memset(erase, 0, image->pages);
+      n_changed = find_changed_pages(handle, &pacing, hid_tx_buf, hid_rx_buf, image->data, image->pages,
+                                     job->options->full, changed, erase);
+      if(n_changed < 0) {
+        error = 1;
+        goto exit;
+      }
+    }
+    msg("%d of %u pages to write\n", n_changed, image->pages);
+  }
+  stats_phase(stats, PHASE_COMPARE, t);
+
+restart:
+  page = next_page = 0;
+  pages_sent = pages_acked = ack_base = 0;
+  n_bytes = 0;
+  erases_pending = 0;
+
+  // Send RESET PAGES command to put HID bootloader in initial stage...
+  memset(hid_tx_buf, 0, sizeof(hid_tx_buf)); //Fill the hid_tx_buf with zeros.
+  memcpy(&hid_tx_buf[1], CMD_RESET_PAGES, sizeof(CMD_RESET_PAGES));
+  if(job->options->blank && !resumes && (info.capabilities & CAP_BLANK_CHIP)) {
+    hid_tx_buf[9] |= RESET_BLANK_CHIP; // Don't erase the flash pages
+  }
+  lz4 = lz4 && (info.capabilities & CAP_LZ4);
+  if(lz4) {
+    hid_tx_buf[9] |= RESET_LZ4; // Pages are compressed
+  }
+  if(lz4 && !packets) {
+    packets = malloc((image->pages + 1) * PACKET_SIZE);
+    packet_sizes = calloc(image->pages + 1, sizeof(uint16_t));
+    if(!packets || !packet_sizes) {
+      msg("Out of memory\n");
+      error = 1;
+      goto exit;
+    }
+  }
+
+  // Without the <erase> command, let the device erase the whole image
+  // before the first page, instead of one sector at a time in the middle
+  // of the transfer. Not when some erase unit is unchanged: it has to be
+  // left as is.
+  if(!(info.capabilities & CAP_ERASE) && (info.capabilities & CAP_ERASE_AHEAD) &&
+     memchr(erase, 0, image->pages) == NULL) {
+    put_le32(&hid_tx_buf[13], image->size);
+    erases_pending = 1;
+  }
+
+  msg("Sending <reset pages> command...\n");
+
+  // Measure the upload from here to the last page acknowledge
+  pacing.stats = stats;
+  t = pacing_now();
+  if(!stats->start) {
+    stats->start = t;
+  }
+
+  // Flash is unavailable when writing to it, so USB interrupt may fail here
+  if(!usb_write(handle, &pacing, hid_tx_buf, HID_TX_SIZE)) {
+    msg("Error while sending <reset pages> command.\n");
+    goto link_error;
+  }
+  memset(hid_tx_buf, 0, sizeof(hid_tx_buf));
+
+  // Erase the sectors to write up front, so that writing the pages does
+  // not wait for them
+  if(info.capabilities & CAP_ERASE) {
+    erases_pending = send_erases(handle, &pacing, hid_tx_buf, hid_rx_buf, erase, image->pages);
+    if(erases_pending < 0) {
+      msg("\nError while sending <erase> command.\n");
+      goto link_error;
+    }
+  }
+
+  // Compress the pages while the device erases
+  for(page = 0; lz4 && page < image->pages; page++) {
+    if(changed[page] && !packet_sizes[page]) {
+      packet_sizes[page] = pack_page(image->data + page * SECTOR_SIZE, packets + page * PACKET_SIZE);
+    }
+  }
+  page = 0;
+
+  for(; erases_pending > 0; erases_pending--) {
+    if(!wait_erase(handle, hid_rx_buf)) {
+      msg("\nError while erasing the flash memory.\n");
+      goto link_error;
+    }
+  }
+
+  stats_phase(stats, PHASE_ERASE, t);
+
+  // Send Firmware File data
+  msg("Flashing firmware...\n");
+
+  while(page < image->pages || pages_acked < pages_sent) {
+
+    // Keep streaming pages while the device programs the previous ones,
+    // up to <window> pages ahead of the acknowledges.
+    while(page < image->pages && pages_sent - pages_acked < (uint32_t)window) {
+      if(!changed[page]) {
+        page++;
+        continue;
+      }
+
+      // Unchanged pages were skipped, move the device to this one
+      t = pacing_now();
+      if(page != next_page) {
+        if(!send_command(handle, &pacing, hid_tx_buf, CMD_SET_PAGE, page, 0)) {
+          msg("Error while sending <set page> command.\n");
+          goto link_error;
+        }
+      }
+
+      if(lz4) {
+        packet = packets + page * PACKET_SIZE;
+        packet_size = packet_sizes[page];
+      }else{
+        packet = image->data + page * SECTOR_SIZE;
+        packet_size = SECTOR_SIZE;
+      }
+      for(int i = 0; i < packet_size; i += HID_TX_SIZE - 1) {
+        memcpy(&hid_tx_buf[1], packet + i, HID_TX_SIZE - 1);
+
+        if((i % 1024) == 0 && !device_number){
+          printf(".");
+        }
+
+        // Flash is unavailable when writing to it, so USB interrupt may fail here
+        if(async ? !usb_write_async(handle, &pacing, hid_tx_buf, HID_TX_SIZE) :
+                   !usb_write(handle, &pacing, hid_tx_buf, HID_TX_SIZE)) {
+          msg("Error while flashing firmware data.\n");
+          goto link_error;
+        }
+        wire_bytes += (HID_TX_SIZE - 1);
+      }
+      n_bytes += SECTOR_SIZE;
+      sent_page[pages_sent % MAX_WINDOW] = page;
+      sent_at[pages_sent % MAX_WINDOW] = pacing_now();
+      latency_add(&stats->page_times, sent_at[pages_sent % MAX_WINDOW] - t);
+      stats_phase(stats, PHASE_SEND, t);
+      pages_sent++;
+      next_page = ++page;
+
+      if(!device_number) {
+        printf(" %d Bytes (%u%%)\n", n_bytes, n_changed ? pages_sent * 100 / n_changed : 100);
+      }
+    }
+
+    if(pages_acked == pages_sent) {
+      continue;
+    }
+
+    // The pages sent have to reach the device before it acknowledges them
+    if(async && hid_write_flush(handle, REPLY_TIMEOUT) < 0) {
+      msg("Error while flashing firmware data.\n");
+      goto link_error;
+    }
+
+    // Newer firmware acknowledges with the count of pages written so far,
+    // older firmware with one reply per page.
+    t = pacing_now();
+    retval = wait_page_written(handle, hid_rx_buf, ACK_TIMEOUT);
+    latency_add(&stats->ack_waits, pacing_now() - t);
+    stats_phase(stats, PHASE_ACK_WAIT, t);
+    if(retval < 0) {
+      msg("\nError while reading from the device.\n");
+      goto link_error;
+    }
+
+    // The acknowledge or the pages were lost. Restart from the erase unit
+    // of the first page not acknowledged: <reset pages> makes the device
+    // erase it again when writing its first page, and restarts the count.
+    // The pages of the unit acknowledged before are sent again.
+    if(retval == 0) {
+      if(!(info.capabilities & CAP_PAGE_CRC) || resends == MAX_RESENDS) {
+        msg("\nNo acknowledge from the device.\n");
+        goto link_error;
+      }
+      page = sent_page[pages_acked % MAX_WINDOW];
+      msg("\nNo acknowledge from the device, sending again from page %u\n", page);
+      if((async && hid_write_flush(handle, REPLY_TIMEOUT) < 0) ||
+         !send_command(handle, &pacing, hid_tx_buf, CMD_RESET_PAGES[7], lz4 ? RESET_LZ4 : 0, 0) ||
+         !send_command(handle, &pacing, hid_tx_buf, CMD_GET_CRC, page, 1) ||
+         !read_reply(handle, hid_rx_buf, CMD_GET_CRC, REPLY_TIMEOUT)) {
+        msg("Error while sending <reset pages> command.\n");
+        goto link_error;
+      }
+      first = hid_rx_buf[12] | (hid_rx_buf[13] << 8);
+      for(; page > first; page--) {
+        pages_acked -= changed[page - 1];
+      }
+      pages_sent = ack_base = pages_acked;
+      n_bytes = pages_sent * SECTOR_SIZE;
+      next_page = 0;
+      resends++;
+      stats->resends++;
+      continue;
+    }
+
+    if(job->firmware_ver >= PROTOCOL_VER) {
+      acked = ack_base + get_le32(&hid_rx_buf[8]);
+    }else{
+      acked = pages_acked + 1;
+    }
+    if(acked > pages_acked && acked <= pages_sent) {
+      pacing_pages_acked(&pacing, acked - pages_acked, sent_at[(acked - 1) % MAX_WINDOW]);
+      pages_acked = acked;
+    }
+  }
+
+  stats->end = pacing_now();
+  pacing.stats = NULL;
+  stats->bytes += n_bytes;
+  stats->wire_bytes = wire_bytes;
+  stats->pages += pages_sent;
+
+  if(!device_number) {
+    printf("\n");
+  }
+  msg("Done!\n");
+  msg("%u us per report, %u us page write latency, %u retries\n",
+    pacing.report_latency, pacing.ack_latency, pacing.errors);
+  if(lz4) {
+    msg("%u bytes sent for %u bytes of pages\n", wire_bytes, stats->bytes);
+  }
+
+  t = pacing_now();
+  if(info.capabilities & CAP_VERIFY) {
+    stats->verified = verify_image(handle, &pacing, hid_tx_buf, hid_rx_buf, image->data, image->size);
+  }
+
+  // Leave the device in the bootloader if the flash content is wrong
+  if(stats->verified == 0) {
+    stats_phase(stats, PHASE_VERIFY, t);
+    error = 1;
+    goto exit;
+  }
+
+  // Send CMD_REBOOT_MCU command to reboot the microcontroller...
+  memset(hid_tx_buf, 0, sizeof(hid_tx_buf));
+  memcpy(&hid_tx_buf[1], CMD_REBOOT_MCU, sizeof(CMD_REBOOT_MCU));
+
+  msg("Sending <reboot mcu> command...\n");
+
+  // Flash is unavailable when writing to it, so USB interrupt may fail here
+  if(!usb_write(handle, &pacing, hid_tx_buf, HID_TX_SIZE)) {
+    msg("Error while sending <reboot mcu> command.\n");
+  }
+  stats_phase(stats, PHASE_VERIFY, t);
+  goto exit;
+
+  // The upload failed, most likely because the USB link dropped. If the
+  // device can tell how far it got, wait for it to come back and resume
+  // from there, instead of writing the whole image again.
+link_error:
+  if(!(info.capabilities & CAP_PROGRESS) || !(info.capabilities & CAP_PAGE_CRC) || !job->serial ||
+     resumes == MAX_RESUMES) {
+    error = 1;
+    goto exit;
+  }
+  resumes++;
+  stats->resumes++;
+  stats->bytes += n_bytes;
+  stats->pages += pages_sent;
+  msg("Waiting for the device to come back...\n");
+  stats->input_overflows += hid_input_overflows(handle);
+  hid_close(handle);
+  handle = job->handle = reconnect(job);
+  if(!handle) {
+    msg("Device not found.\n");
+    error = 1;
+    goto exit;
+  }
+  n_changed = resume_pages(handle, &pacing, hid_tx_buf, hid_rx_buf, image->data, image->pages, changed, erase);
+  if(n_changed < 0) {
+    error = 1;
+    goto exit;
+  }
+  msg("%d of %u pages to write\n", n_changed, image->pages);
+  goto restart;
+
+exit:
+  free(changed);
+  free(erase);
+  free(packets);
+  free(packet_sizes);
+  job->error = error;
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  image_t image;
+  options_t options;
+  int error = 0;
   int i;
   setbuf(stdout, NULL);
   uint8_t _timer = 0;
-  
+  char *args[3] = {NULL, NULL, NULL};
+  int n_args = 0;
+  int all = 0;
+  job_t *jobs = NULL;
+  int n_jobs = 0;
+  char *json_path = NULL;
+  int print_stats = 0;
+  uint64_t begin = pacing_now();
+  uint64_t serial_us = 0;
+  uint64_t enumerate_us = 0;
+  uint64_t t;
+
+  options.window = MAX_WINDOW;
+  options.full = 0;
+  options.blank = 0;
+  options.lz4 = 0;
+  options.n_serials = 0;
+  options.n_paths = 0;
+
   printf("\n+-----------------------------------------------------------------------+\n");
   printf  ("|         HID-Flash v2.2.1 - STM32 HID Bootloader Flash Tool            |\n");
   printf  ("|     (c)      2018 - Bruno Freitas       http://www.brunofreitas.com   |\n");
   printf  ("|     (c) 2018-2019 - Vassilis Serasidis  https://www.serasidis.gr      |\n");
   printf  ("|   Customized for STM32duino ecosystem   https://www.stm32duino.com    |\n");
   printf  ("+-----------------------------------------------------------------------+\n\n");
-  
-  if(argc < 3) {
-    printf("Usage: hid-flash <bin_firmware_file> <comport> <delay (optional)>\n");
+
+  for(i = 1; i < argc; i++) {
+    if(strncmp(argv[i], "--window=", 9) == 0) {
+      options.window = atoi(argv[i] + 9);
+      if(options.window < 1 || options.window > MAX_WINDOW) {
+        printf("> Invalid page window: %s\n", argv[i] + 9);
+        return 1;
+      }
+    }else if(strcmp(argv[i], "--full") == 0) {
+      options.full = 1;
+    }else if(strcmp(argv[i], "--blank") == 0) {
+      options.blank = 1;
+    }else if(strcmp(argv[i], "--compress") == 0) {
+      options.lz4 = 1;
+    }else if(strcmp(argv[i], "--all") == 0) {
+      all = 1;
+    }else if(strncmp(argv[i], "--serial=", 9) == 0 && options.n_serials < MAX_SELECTORS) {
+      options.serials[options.n_serials++] = argv[i] + 9;
+    }else if(strncmp(argv[i], "--path=", 7) == 0 && options.n_paths < MAX_SELECTORS) {
+      options.paths[options.n_paths++] = argv[i] + 7;
+    }else if(strncmp(argv[i], "--json=", 7) == 0) {
+      json_path = argv[i] + 7;
+    }else if(strcmp(argv[i], "--stats") == 0) {
+      print_stats = 1;
+    }else if(strncmp(argv[i], "--", 2) == 0 || n_args == 3) {
+      n_args = 0;
+      break;
+    }else{
+      args[n_args++] = argv[i];
+    }
+  }
+
+  if(n_args < 2) {
+    printf("Usage: hid-flash [--window=<pages>] [--full] [--blank] [--compress] [--all] [--serial=<serial>] [--path=<path>] [--json=<file>] [--stats] <bin_firmware_file> <comport> <delay (optional)>\n");
     return 1;
-  }else if(argc == 4){
-    _timer = atol(argv[3]);
+  }else if(n_args == 3){
+    _timer = atol(args[2]);
   }
-  
-  firmware_file = fopen(argv[1], "rb");
-  if(!firmware_file) {
-    printf("> Error opening firmware file: %s\n", argv[1]);
-    return error;
+
+  // Map the image, or read it whole from stdin ("-") or a pipe
+  if(!image_open(&image, args[0], SECTOR_SIZE)) {
+    printf("> Error reading firmware file: %s\n", args[0]);
+    return 1;
   }
-  
-  if(serial_init(argv[2], _timer) == 0){ //Setting up Serial port
+
+  t = pacing_now();
+  if(serial_init(args[1], _timer) == 0){ //Setting up Serial port
     RS232_CloseComport();
   }else{
-    printf("> Unable to open the [%s]\n",argv[2]);
+    printf("> Unable to open the [%s]\n",args[1]);
   }
-  
+  serial_us = pacing_now() - t;
+
   hid_init();
-  
+
   printf("> Searching for [%04X:%04X] device...\n",VID,PID);
-  
-  struct hid_device_info *devs, *cur_dev;
+  t = pacing_now();
+
+  struct hid_device_info *devs = NULL, *cur_dev;
   uint8_t valid_hid_devices = 0;
-  
+
   for(i=0;i<10;i++){ //Try up to 10 times to open the HID device.
     devs = hid_enumerate(VID, PID);
     cur_dev = devs;
     while (cur_dev) { //Search for valid HID Bootloader USB devices
-      if((cur_dev->vendor_id == VID)&&(cur_dev->product_id = PID)){
+      if((cur_dev->vendor_id == VID)&&(cur_dev->product_id = PID)&&device_selected(&options, cur_dev)){
         valid_hid_devices++;
         if(cur_dev->release_number < FIRMWARE_VER){ //The STM32 board has firmware lower than 3.00
           printf("\nError - Please update the firmware to the latest version (v3.00+)");
+          hid_free_enumeration(devs);
+          error = 1;
           goto exit;
         }
       }
       cur_dev = cur_dev->next;
     }
-    hid_free_enumeration(devs);
     printf("#");
     sleep(1);
     if(valid_hid_devices > 0) break;
+    hid_free_enumeration(devs);
+    devs = NULL;
   }
   if (valid_hid_devices == 0){
     printf("\nError - [%04X:%04X] device is not found :(",VID,PID);
     error = 1;
     goto exit;
-  } 
-  
-  handle = hid_open(VID, PID, NULL);
-  
-  if (i == 10 && handle != NULL) {
-    printf("\n> Unable to open the [%04X:%04X] device.\n",VID,PID);
-    error = 1;
-    goto exit;
   }
- 
-  printf("\n> [%04X:%04X] device is found !\n",VID,PID);
-  
-  // Send RESET PAGES command to put HID bootloader in initial stage...
-  memset(hid_tx_buf, 0, sizeof(hid_tx_buf)); //Fill the hid_tx_buf with zeros.
-  memcpy(&hid_tx_buf[1], CMD_RESET_PAGES, sizeof(CMD_RESET_PAGES));
-
-  printf("> Sending <reset pages> command...\n");
 
-  // Flash is unavailable when writing to it, so USB interrupt may fail here
-  if(!usb_write(handle, hid_tx_buf, HID_TX_SIZE)) {
-    printf("> Error while sending <reset pages> command.\n");
+  // Flash the first device found, or all of them with --all. Only the ones
+  // picked with --serial or --path, if any.
+  if(!all) {
+    valid_hid_devices = 1;
+  }
+  jobs = calloc(valid_hid_devices, sizeof(job_t));
+  for(cur_dev = devs; jobs && cur_dev && n_jobs < valid_hid_devices; cur_dev = cur_dev->next) {
+    if(cur_dev->vendor_id != VID || !device_selected(&options, cur_dev)) {
+      continue;
+    }
+    jobs[n_jobs].image = &image;
+    jobs[n_jobs].options = &options;
+    jobs[n_jobs].path = strdup(cur_dev->path);
+    jobs[n_jobs].serial = serial_string(cur_dev->serial_number);
+    jobs[n_jobs].firmware_ver = cur_dev->release_number;
+    jobs[n_jobs].number = all ? n_jobs + 1 : 0;
+    stats_init(&jobs[n_jobs].stats);
+    jobs[n_jobs].stats.begin = begin;
+    jobs[n_jobs].stats.phase_us[PHASE_SERIAL] = serial_us;
+    jobs[n_jobs].handle = hid_open_path(cur_dev->path);
+    if(jobs[n_jobs].handle == NULL) {
+      printf("\n> Unable to open the [%04X:%04X] device at %s.\n",VID,PID,cur_dev->path);
+      jobs[n_jobs].error = 1;
+      error = 1;
+    }
+    n_jobs++;
+  }
+  hid_free_enumeration(devs);
+  enumerate_us = pacing_now() - t;
+  if(!jobs) {
+    printf("\n> Out of memory\n");
     error = 1;
     goto exit;
   }
-  memset(hid_tx_buf, 0, sizeof(hid_tx_buf));
-
-  // Send Firmware File data
-  printf("> Flashing firmware...\n");
-
-  memset(page_data, 0, sizeof(page_data));
-  read_bytes = fread(page_data, 1, sizeof(page_data), firmware_file);
-
-  while(read_bytes > 0) {
-
-    for(int i = 0; i < SECTOR_SIZE; i += HID_TX_SIZE - 1) {
-      memcpy(&hid_tx_buf[1], page_data + i, HID_TX_SIZE - 1);
+  for(i = 0; i < n_jobs; i++) {
+    jobs[i].stats.phase_us[PHASE_ENUMERATE] = enumerate_us;
+  }
 
-      if((i % 1024) == 0){
-        printf(".");
+  if(!all) {
+    if(jobs[0].handle) {
+      printf("\n> [%04X:%04X] device is found !\n",VID,PID);
+      if(jobs[0].serial) {
+        printf("> Serial number %s\n", jobs[0].serial);
       }
-      
-      // Flash is unavailable when writing to it, so USB interrupt may fail here
-      if(!usb_write(handle, hid_tx_buf, HID_TX_SIZE)) {
-        printf("> Error while flashing firmware data.\n");
-        error = 1;
-        goto exit;
+      flash_device(&jobs[0]);
+    }
+  }else{
+    printf("\n> %d [%04X:%04X] devices found, flashing them in parallel\n", n_jobs, VID, PID);
+    for(i = 0; i < n_jobs; i++) {
+      if(jobs[i].handle && pthread_create(&jobs[i].thread, NULL, flash_device, &jobs[i]) != 0) {
+        printf("> [%d] Unable to start the upload\n", jobs[i].number);
+        hid_close(jobs[i].handle);
+        jobs[i].handle = NULL;
+        jobs[i].error = 1;
+      }
+    }
+    for(i = 0; i < n_jobs; i++) {
+      if(jobs[i].handle) {
+        pthread_join(jobs[i].thread, NULL);
       }
-      n_bytes += (HID_TX_SIZE - 1);
-      usleep(500);
     }
-    
-    printf(" %d Bytes\n", n_bytes);
-
-    do{
-      hid_read(handle, hid_rx_buf, 9);
-      usleep(500);
-    }while(hid_rx_buf[7] != 0x02);
-    
-    memset(page_data, 0, sizeof(page_data));
-    read_bytes = fread(page_data, 1, sizeof(page_data), firmware_file);
   }
 
-  printf("\n> Done!\n");
-  
-  // Send CMD_REBOOT_MCU command to reboot the microcontroller...
-  memset(hid_tx_buf, 0, sizeof(hid_tx_buf));
-  memcpy(&hid_tx_buf[1], CMD_REBOOT_MCU, sizeof(CMD_REBOOT_MCU));
-
-  printf("> Sending <reboot mcu> command...\n");
-
-  // Flash is unavailable when writing to it, so USB interrupt may fail here
-  if(!usb_write(handle, hid_tx_buf, HID_TX_SIZE)) {
-    printf("> Error while sending <reboot mcu> command.\n");
+  // Results per device
+  for(i = 0; i < n_jobs; i++) {
+    error |= jobs[i].error;
+    // The upload end is only set once the last page is acknowledged
+    if(all && jobs[i].stats.end >= jobs[i].stats.start) {
+      printf("> [%d] %s (%s): %s, %u pages in %llu ms\n", jobs[i].number, jobs[i].path,
+        jobs[i].serial ? jobs[i].serial : "no serial number", jobs[i].error ? "FAILED" : "OK", jobs[i].stats.pages,
+        (unsigned long long)((jobs[i].stats.end - jobs[i].stats.start) / 1000));
+    }else if(all) {
+      printf("> [%d] %s (%s): FAILED, %u pages written\n", jobs[i].number, jobs[i].path,
+        jobs[i].serial ? jobs[i].serial : "no serial number", jobs[i].stats.pages);
+    }
   }
-  
+
 exit:
-  if(handle) {
-    hid_close(handle);
+  for(i = 0; i < n_jobs; i++) {
+    if(jobs[i].handle) {
+      jobs[i].stats.input_overflows += hid_input_overflows(jobs[i].handle);
+      hid_close(jobs[i].handle);
+    }
   }
 
   hid_exit();
 
-  if(firmware_file) {
-    fclose(firmware_file);
-  }
-  
-  printf("> Searching for [%s] ...\n",argv[2]);
+  image_close(&image);
+
+  printf("> Searching for [%s] ...\n",args[1]);
+  t = pacing_now();
 
   for(int i=0;i<5;i++){
-    if(RS232_OpenComport(argv[2]) == 0){
-      printf("> [%s] is found !\n",argv[2] );
+    if(RS232_OpenComport(args[1]) == 0){
+      printf("> [%s] is found !\n",args[1] );
       break;
     }
     sleep(1);
   }
-  
+
   if(i==5){
     printf("> Comport is not found\n");
   }
+  t = pacing_now() - t;
   printf("> Finish\n");
-  
+
+  for(i = 0; i < n_jobs; i++) {
+    jobs[i].stats.phase_us[PHASE_PORT_SEARCH] = t;
+    jobs[i].stats.error = jobs[i].error;
+    jobs[i].stats.device = jobs[i].path;
+    jobs[i].stats.serial = jobs[i].serial;
+    if(print_stats) {
+      if(all) {
+        printf("\n> [%d] %s", jobs[i].number, jobs[i].path);
+      }
+      stats_print(&jobs[i].stats);
+    }
+  }
+  if(json_path && n_jobs > 0) {
+    stats_t *list[n_jobs];
+    for(i = 0; i < n_jobs; i++) {
+      list[i] = &jobs[i].stats;
+    }
+    if(!stats_write_json(list, n_jobs, json_path)) {
+      printf("> Error writing %s\n", json_path);
+    }
+  }
+  for(i = 0; i < n_jobs; i++) {
+    stats_free(&jobs[i].stats);
+    free(jobs[i].path);
+    free(jobs[i].serial);
+  }
+  free(jobs);
+
   return error;
 }
 
@@ -0,0 +1,116 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include "pacing.h"
+
+#define MIN_BACKOFF          1000 // us
+#define MAX_BACKOFF        100000 // us
+#define MAX_REPORT_DELAY    10000 // us
+#define SPEEDUP_PAGES           4 // error-free pages before the delay is halved
+
+// Monotonic time in us, wall clock time where there is no monotonic clock
+uint64_t pacing_now(void) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+// Exponential moving average, 1/8 weight for the new sample
+static uint32_t average(uint32_t avg, uint32_t sample) {
+  if(avg == 0) {
+    return sample;
+  }
+  return avg - (avg >> 3) + (sample >> 3);
+}
+
+void pacing_init(pacing_t *pacing, uint32_t report_delay) {
+  pacing->report_delay = report_delay;
+  pacing->report_latency = 0;
+  pacing->ack_latency = 0;
+  pacing->backoff = MIN_BACKOFF;
+  pacing->clean_pages = 0;
+  pacing->errors = 0;
+  pacing->stats = NULL;
+}
+
+// Waits the current delay between reports and returns the start time
+// of the next one.
+uint64_t pacing_report_start(pacing_t *pacing) {
+  if(pacing->report_delay) {
+    usleep(pacing->report_delay);
+  }
+  return pacing_now();
+}
+
+void pacing_report_done(pacing_t *pacing, uint64_t start) {
+  uint32_t latency = pacing_now() - start;
+
+  pacing->report_latency = average(pacing->report_latency, latency);
+  pacing->backoff = MIN_BACKOFF;
+  if(pacing->stats) {
+    latency_add(&pacing->stats->report_times, latency);
+    pacing->stats->reports++;
+  }
+}
+
+// The device did not take the report (e.g. it is busy writing to flash).
+// Slow down, and wait before retrying.
+void pacing_report_failed(pacing_t *pacing) {
+  pacing->errors++;
+  if(pacing->stats) {
+    pacing->stats->retries++;
+  }
+  pacing->clean_pages = 0;
+  pacing->report_delay = pacing->report_delay * 2 + 250;
+  if(pacing->report_delay > MAX_REPORT_DELAY) {
+    pacing->report_delay = MAX_REPORT_DELAY;
+  }
+
+  usleep(pacing->backoff);
+  pacing->backoff *= 2;
+  if(pacing->backoff > MAX_BACKOFF) {
+    pacing->backoff = MAX_BACKOFF;
+  }
+}
+
+// <pages> more pages have been acknowledged, the last of them was sent
+// at <sent_at>.
+void pacing_pages_acked(pacing_t *pacing, uint32_t pages, uint64_t sent_at) {
+  uint32_t latency = pacing_now() - sent_at;
+
+  pacing->ack_latency = average(pacing->ack_latency, latency);
+  if(pacing->stats) {
+    latency_add(&pacing->stats->ack_times, latency);
+  }
+  pacing->clean_pages += pages;
+  if(pacing->clean_pages >= SPEEDUP_PAGES) {
+    pacing->clean_pages = 0;
+    pacing->report_delay /= 2;
+  }
+}
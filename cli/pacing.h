@@ -0,0 +1,47 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#ifndef pacing_INCLUDED
+#define pacing_INCLUDED
+
+#include <stdint.h>
+#include "stats.h"
+
+// Paces the reports sent to the bootloader. The delay between reports
+// starts from a hint (0 for devices with an interrupt OUT endpoint) and
+// follows what the device actually sustains: it grows when writes fail
+// and shrinks again while pages keep being acknowledged without errors.
+// Retries after a failed write back off exponentially.
+typedef struct {
+  uint32_t report_delay;   // us between two reports
+  uint32_t report_latency; // average hid_write() completion time, us
+  uint32_t ack_latency;    // average last report to page ACK time, us
+  uint32_t backoff;        // us to wait before the next retry
+  uint32_t clean_pages;    // pages acknowledged since the last error
+  uint32_t errors;         // failed writes
+  stats_t *stats;          // measures recorded for --json, or NULL
+} pacing_t;
+
+uint64_t pacing_now(void);
+void pacing_init(pacing_t *pacing, uint32_t report_delay);
+uint64_t pacing_report_start(pacing_t *pacing);
+void pacing_report_done(pacing_t *pacing, uint64_t start);
+void pacing_report_failed(pacing_t *pacing);
+void pacing_pages_acked(pacing_t *pacing, uint32_t pages, uint64_t sent_at);
+
+#endif
@@ -0,0 +1,249 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pacing.h"
+#include "stats.h"
+
+// Histogram buckets: 0 us, then [2^(i-1), 2^i) us
+#define BUCKETS     33
+
+static const char *phase_names[PHASES] = {
+  "serial", "enumerate", "compare", "erase", "send", "ack_wait", "verify", "port_search"
+};
+
+static const char *phase_labels[PHASES] = {
+  "Serial port, DTR toggling", "Device enumeration", "Get info, CRC compare",
+  "Reset pages, erase", "Page send", "ACK wait", "Verify, reboot", "Serial port search"
+};
+
+void latency_add(latency_t *latency, uint32_t us) {
+  uint32_t *samples;
+
+  if(latency->count == latency->size) {
+    samples = realloc(latency->samples, (latency->size + 1024) * sizeof(uint32_t));
+    if(!samples) {
+      return;
+    }
+    latency->samples = samples;
+    latency->size += 1024;
+  }
+  latency->samples[latency->count++] = us;
+  latency->total += us;
+}
+
+static int compare_samples(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile, 0 without samples
+uint32_t latency_percentile(latency_t *latency, int percent) {
+  uint32_t rank;
+
+  if(latency->count == 0) {
+    return 0;
+  }
+  qsort(latency->samples, latency->count, sizeof(uint32_t), compare_samples);
+  rank = ((uint64_t)latency->count * percent + 99) / 100;
+  return latency->samples[rank ? rank - 1 : 0];
+}
+
+static void histogram(const latency_t *latency, uint32_t *counts) {
+  uint32_t i, us;
+  int bucket;
+
+  memset(counts, 0, BUCKETS * sizeof(uint32_t));
+  for(i = 0; i < latency->count; i++) {
+    for(bucket = 0, us = latency->samples[i]; us; bucket++) {
+      us >>= 1;
+    }
+    counts[bucket]++;
+  }
+}
+
+static uint32_t bucket_start(int bucket) {
+  return bucket ? 1u << (bucket - 1) : 0;
+}
+
+void stats_init(stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->begin = pacing_now();
+  stats->verified = -1;
+}
+
+void stats_free(stats_t *stats) {
+  free(stats->report_times.samples);
+  free(stats->page_times.samples);
+  free(stats->ack_times.samples);
+  free(stats->ack_waits.samples);
+  memset(&stats->report_times, 0, sizeof(latency_t));
+  memset(&stats->page_times, 0, sizeof(latency_t));
+  memset(&stats->ack_times, 0, sizeof(latency_t));
+  memset(&stats->ack_waits, 0, sizeof(latency_t));
+}
+
+// Add the time since <start> to <phase>
+void stats_phase(stats_t *stats, phase_t phase, uint64_t start) {
+  stats->phase_us[phase] += pacing_now() - start;
+}
+
+static void print_latency(const char *label, latency_t *latency) {
+  uint32_t counts[BUCKETS];
+  int bucket;
+
+  if(latency->count == 0) {
+    return;
+  }
+  printf("> %s: %u samples, mean %u us, p50 %u us, p90 %u us, p99 %u us, max %u us\n",
+    label, latency->count, (uint32_t)(latency->total / latency->count),
+    latency_percentile(latency, 50), latency_percentile(latency, 90),
+    latency_percentile(latency, 99), latency_percentile(latency, 100));
+  histogram(latency, counts);
+  for(bucket = 0; bucket < BUCKETS; bucket++) {
+    if(counts[bucket]) {
+      printf(">   %8u - %8u us  %6u\n", bucket_start(bucket),
+        bucket ? (uint32_t)((2ull << (bucket - 1)) - 1) : 0, counts[bucket]);
+    }
+  }
+}
+
+// Time breakdown and latency histograms, for --stats
+void stats_print(stats_t *stats) {
+  uint64_t total = pacing_now() - stats->begin;
+  uint64_t other = total;
+  int phase;
+
+  printf("\n> Time breakdown:\n");
+  for(phase = 0; phase < PHASES; phase++) {
+    printf(">   %-28s %8llu ms\n", phase_labels[phase],
+      (unsigned long long)(stats->phase_us[phase] / 1000));
+    other = other > stats->phase_us[phase] ? other - stats->phase_us[phase] : 0;
+  }
+  printf(">   %-28s %8llu ms\n", "Other", (unsigned long long)(other / 1000));
+  printf(">   %-28s %8llu ms\n", "Total", (unsigned long long)(total / 1000));
+  printf("> Input reports dropped: %u\n", stats->input_overflows);
+  print_latency("Report write time", &stats->report_times);
+  print_latency("Page send time", &stats->page_times);
+  print_latency("Page ACK latency", &stats->ack_times);
+  print_latency("ACK wait", &stats->ack_waits);
+}
+
+static void write_latency(FILE *file, const char *name, latency_t *latency) {
+  uint32_t counts[BUCKETS];
+  int bucket, first = 1;
+
+  fprintf(file, ",\"%s\":{\"count\":%u,\"mean\":%u,\"p50\":%u,\"p90\":%u,\"p99\":%u,\"max\":%u,\"histogram\":[",
+    name, latency->count,
+    latency->count ? (uint32_t)(latency->total / latency->count) : 0,
+    latency_percentile(latency, 50), latency_percentile(latency, 90),
+    latency_percentile(latency, 99), latency_percentile(latency, 100));
+
+  // [first us of the bucket, samples], non-empty buckets only
+  histogram(latency, counts);
+  for(bucket = 0; bucket < BUCKETS; bucket++) {
+    if(counts[bucket]) {
+      fprintf(file, "%s[%u,%u]", first ? "" : ",", bucket_start(bucket), counts[bucket]);
+      first = 0;
+    }
+  }
+  fprintf(file, "]}");
+}
+
+// JSON string, escaping quotes, backslashes (Windows device paths) and
+// control characters
+static void write_string(FILE *file, const char *string) {
+  fputc('"', file);
+  for(; *string; string++) {
+    if(*string == '"' || *string == '\\') {
+      fprintf(file, "\\%c", *string);
+    }else if((unsigned char)*string < 0x20) {
+      fprintf(file, "\\u%04x", *string);
+    }else{
+      fputc(*string, file);
+    }
+  }
+  fputc('"', file);
+}
+
+static void write_stats(FILE *file, stats_t *stats) {
+  uint64_t us = stats->end > stats->start ? stats->end - stats->start : 0;
+  double seconds = us / 1e6;
+  int phase;
+
+  fprintf(file, "{");
+  if(stats->device) {
+    fprintf(file, "\"device\":");
+    write_string(file, stats->device);
+    fprintf(file, ",");
+  }
+  if(stats->serial) {
+    fprintf(file, "\"serial\":");
+    write_string(file, stats->serial);
+    fprintf(file, ",");
+  }
+  fprintf(file, "\"error\":%s,\"bytes\":%u,\"wire_bytes\":%u,\"reports\":%u,\"pages\":%u,\"upload_us\":%llu,",
+    stats->error ? "true" : "false", stats->bytes, stats->wire_bytes, stats->reports, stats->pages,
+    (unsigned long long)us);
+  fprintf(file, "\"bytes_per_s\":%.0f,\"reports_per_s\":%.0f,\"retries\":%u,\"resends\":%u,\"resumes\":%u,"
+    "\"input_overflows\":%u,\"verified\":%s,",
+    us ? stats->bytes / seconds : 0, us ? stats->reports / seconds : 0, stats->retries, stats->resends,
+    stats->resumes, stats->input_overflows,
+    stats->verified < 0 ? "null" : stats->verified ? "true" : "false");
+  fprintf(file, "\"phases_us\":{");
+  for(phase = 0; phase < PHASES; phase++) {
+    fprintf(file, "\"%s\":%llu,", phase_names[phase], (unsigned long long)stats->phase_us[phase]);
+  }
+  fprintf(file, "\"total\":%llu}", (unsigned long long)(pacing_now() - stats->begin));
+  write_latency(file, "report_us", &stats->report_times);
+  write_latency(file, "page_send_us", &stats->page_times);
+  write_latency(file, "ack_us", &stats->ack_times);
+  write_latency(file, "ack_wait_us", &stats->ack_waits);
+  fprintf(file, "}");
+}
+
+// Write the measures of one device as one JSON object, of several devices
+// as an array of objects, to stdout if <path> is "-".
+// Returns 0 if the file cannot be written.
+int stats_write_json(stats_t **stats, int count, const char *path) {
+  FILE *file = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+  int i;
+
+  if(!file) {
+    return 0;
+  }
+  if(count == 1) {
+    write_stats(file, stats[0]);
+  }else{
+    fprintf(file, "[");
+    for(i = 0; i < count; i++) {
+      fprintf(file, "%s\n ", i ? "," : "");
+      write_stats(file, stats[i]);
+    }
+    fprintf(file, "\n]");
+  }
+  fprintf(file, "\n");
+  if(file != stdout) {
+    return fclose(file) == 0;
+  }
+  return 1;
+}
@@ -0,0 +1,79 @@
+/*
+* STM32 HID Bootloader - USB HID bootloader for STM32F10X
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*/
+
+#ifndef stats_INCLUDED
+#define stats_INCLUDED
+
+#include <stdint.h>
+
+// Latency samples (us), kept whole to report exact percentiles
+typedef struct {
+  uint32_t *samples;
+  uint32_t count;
+  uint32_t size;
+  uint64_t total;
+} latency_t;
+
+// Where the time goes, from start to exit
+typedef enum {
+  PHASE_SERIAL,       // serial port open, DTR toggling and magic
+  PHASE_ENUMERATE,    // device search and open
+  PHASE_COMPARE,      // <get info>, flash CRC compare
+  PHASE_ERASE,        // <reset pages>, erase (and page packing meanwhile)
+  PHASE_SEND,         // page reports written
+  PHASE_ACK_WAIT,     // waiting for page acknowledges
+  PHASE_VERIFY,       // <verify> and <reboot mcu>
+  PHASE_PORT_SEARCH,  // serial port search after the reboot
+  PHASES
+} phase_t;
+
+typedef struct {
+  const char *device;      // device path, or NULL
+  const char *serial;      // device serial number, or NULL
+  uint64_t begin;          // us, pacing_now() time
+  uint64_t phase_us[PHASES];
+  int error;
+
+  // Upload, from <reset pages> to the last page acknowledge
+  uint64_t start;
+  uint64_t end;
+  uint32_t bytes;          // page bytes written
+  uint32_t wire_bytes;     // bytes sent for them (compressed)
+  uint32_t reports;        // OUT reports sent
+  uint32_t pages;          // pages written
+  uint32_t retries;        // failed report writes
+  uint32_t resends;        // acknowledge timeouts, pages sent again
+  uint32_t resumes;        // USB link drops, upload resumed
+  uint32_t input_overflows; // input reports dropped by the HID backend
+  int verified;            // 1: CRC verified, 0: not, -1: not supported
+  latency_t report_times;  // hid_write() completion, hid_write_async() queueing
+  latency_t page_times;    // all the reports of a page
+  latency_t ack_times;     // last report of a page to its acknowledge
+  latency_t ack_waits;     // blocked waiting for an acknowledge
+} stats_t;
+
+void latency_add(latency_t *latency, uint32_t us);
+uint32_t latency_percentile(latency_t *latency, int percent);
+
+void stats_init(stats_t *stats);
+void stats_free(stats_t *stats);
+void stats_phase(stats_t *stats, phase_t phase, uint64_t start);
+void stats_print(stats_t *stats);
+int stats_write_json(stats_t **stats, int count, const char *path);
+
+#endif